@@ -0,0 +1,100 @@
+#!/bin/sh
+# Benchmarks every solver on every instance family over a range of n, and writes
+# one CSV row per (family, solver, n) to stdout: the median and 95th percentile
+# wall time of RUNS runs, the median solve time, proposals per second of solving,
+# and the largest peak RSS. Run i of every combination uses seed i, so the solvers
+# are compared on the same instances and results repeat from one sweep to the next.
+#
+# Settings come from the environment:
+#   SM          solver binary (./sm)
+#   SIZES       n for the stored solvers ("1000 3000 10000")
+#   LAZY_SIZES  n for the lazy solver, which needs no matrices ("1000 3000 10000 100000")
+#   SCAN_MAX_N  largest n run with the O(n)-per-proposal scan solver (3000)
+#   FAMILIES    instance families ("uniform identical master popularity adversarial correlated")
+#   SOLVERS     solvers ("scan rank lifo pipelined parallel lazy")
+#   RUNS        runs per combination (5)
+#   THREADS     threads for the parallel solver (all online CPUs)
+
+SM=${SM:-./sm}
+SIZES=${SIZES:-"1000 3000 10000"}
+LAZY_SIZES=${LAZY_SIZES:-"1000 3000 10000 100000"}
+SCAN_MAX_N=${SCAN_MAX_N:-3000}
+FAMILIES=${FAMILIES:-"uniform identical master popularity adversarial correlated"}
+SOLVERS=${SOLVERS:-"scan rank lifo pipelined parallel lazy"}
+RUNS=${RUNS:-5}
+THREADS=${THREADS:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)}
+
+# Options for each solver: scan and rank sweep over all sellers in rounds as the
+# original solver did, lifo keeps the free sellers on a stack
+solver_flags() {
+    case $1 in
+    scan) echo "--solver scan --schedule round-robin" ;;
+    rank) echo "--solver rank --schedule round-robin" ;;
+    lifo) echo "--solver rank --schedule lifo" ;;
+    pipelined) echo "--solver pipelined" ;;
+    parallel) echo "--solver parallel --threads $THREADS" ;;
+    lazy) echo "--lazy" ;;
+    *) echo "bench.sh: unknown solver $1" >&2; exit 1 ;;
+    esac
+}
+
+# Reduces the CSV timing lines of one combination's runs to its summary row
+summarize() {
+    awk -F, -v family="$1" -v solver="$2" -v n="$3" '
+        NR == 1 { for (i = 1; i <= NF; i++) col[$i] = i; next }
+        $1 == "n" { next }
+        {
+            k++
+            wall[k] = $col["wall_ns"]
+            solve[k] = $col["solve_ns"]
+            proposals += $col["proposals"]
+            solve_total += $col["solve_ns"]
+            if ($col["peak_rss_kb"] > rss) rss = $col["peak_rss_kb"]
+        }
+        function sort(a, m,    i, j, t) {
+            for (i = 2; i <= m; i++)
+                for (j = i; j > 1 && a[j - 1] > a[j]; j--) { t = a[j]; a[j] = a[j - 1]; a[j - 1] = t }
+        }
+        END {
+            if (k == 0) exit 1
+            sort(wall, k)
+            sort(solve, k)
+            p95 = int(0.95 * k); if (p95 < 0.95 * k) p95++
+            printf "%s,%s,%s,%d,%.3f,%.3f,%.3f,%.0f,%d\n", family, solver, n, k,
+                   wall[int((k + 1) / 2)] / 1e6, wall[p95] / 1e6, solve[int((k + 1) / 2)] / 1e6,
+                   (solve_total > 0 ? proposals / solve_total * 1e9 : 0), rss
+        }'
+}
+
+if [ ! -x "$SM" ]; then
+    echo "bench.sh: $SM not found; build it with make first" >&2
+    exit 1
+fi
+echo "family,solver,n,runs,median_wall_ms,p95_wall_ms,median_solve_ms,proposals_per_sec,peak_rss_kb"
+for family in $FAMILIES; do
+    for solver in $SOLVERS; do
+        sizes=$SIZES
+        if [ "$solver" = lazy ]; then
+            # Lazy instances are always uniformly random
+            [ "$family" = uniform ] || continue
+            sizes=$LAZY_SIZES
+        fi
+        flags=$(solver_flags "$solver") || exit 1
+        for n in $sizes; do
+            if [ "$solver" = scan ] && [ "$n" -gt "$SCAN_MAX_N" ]; then
+                continue
+            fi
+            family_flags="--family $family"
+            [ "$solver" = lazy ] && family_flags=
+            run=1
+            while [ "$run" -le "$RUNS" ]; do
+                # The timing report goes to stderr; the matching itself is discarded
+                $SM $flags $family_flags --no-prefs --timing csv --seed "$run" "$n" 2>&1 >/dev/null
+                run=$((run + 1))
+            done | summarize "$family" "$solver" "$n" || {
+                echo "bench.sh: no results for $family $solver at n = $n" >&2
+                exit 1
+            }
+        done
+    done
+done
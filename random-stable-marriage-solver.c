@@ -1,136 +1,2147 @@
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <stdbool.h>
 #include <math.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
-/* For making an array of integers 1 through n in a random order. Copied from
-   https://benpfaff.org/writings/clc/shuffle.html */
-void shuffle_array(int *array, int n) {
-    for (int i = 0; i < n - 1; i++) {
-        int j = i + rand() / (RAND_MAX / (n - i) + 1);
-        int t = array[j];
-        array[j] = array[i];
-        array[i] = t;
+#include "sm.h"
+
+/* Which side proposes. The core always has "sellers" propose; buyers propose by
+   solving a mirrored view of the instance with the two sides' roles swapped. */
+enum proposer {
+    PROPOSER_SELLERS,  // the seller-optimal matching
+    PROPOSER_BUYERS,   // the buyer-optimal matching
+    PROPOSER_BOTH      // both, solved concurrently
+};
+
+/* Buffered output. Numbers are formatted by hand into a large buffer that goes out
+   in one fwrite each time it fills, rather than through one printf call apiece. */
+#define OUTBUF_SIZE (1 << 20)
+
+struct outbuf {
+    FILE *f;
+    size_t len;
+    char buf[OUTBUF_SIZE];
+};
+
+static void out_flush(struct outbuf *out) {
+    if (out->len > 0 && fwrite(out->buf, 1, out->len, out->f) != out->len) {
+        perror("write");
+        exit(1);
     }
+    out->len = 0;
 }
 
-int main(int argc, char **argv) {
-    /* Record time we started execution, to measure performance */
-    time_t start_time;
-    srand(time(&start_time));
-
-    /* Check for input value for n; use default if none */
-    int n = 0;  
-    if (argc == 1) { // no command line arguments
-        printf("Usage: ./sm <value for n>\n"); 
+/* Makes room for at least k more bytes */
+static inline void out_reserve(struct outbuf *out, size_t k) {
+    if (out->len + k > OUTBUF_SIZE) {
+        out_flush(out);
+    }
+}
+
+static inline void out_char(struct outbuf *out, char c) {
+    out_reserve(out, 1);
+    out->buf[out->len++] = c;
+}
+
+static inline void out_str(struct outbuf *out, const char *str) {
+    size_t k = strlen(str);
+    if (k > OUTBUF_SIZE) {
+        out_flush(out);
+        fputs(str, out->f);
+        return;
+    }
+    out_reserve(out, k);
+    memcpy(out->buf + out->len, str, k);
+    out->len += k;
+}
+
+/* Every two-digit number, so digits can be emitted two at a time */
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static inline void out_uint(struct outbuf *out, uint32_t v) {
+    char tmp[10];
+    char *p = tmp + sizeof(tmp);
+    while (v >= 100) {
+        uint32_t pair = (v % 100) * 2;
+        v /= 100;
+        *--p = digit_pairs[pair + 1];
+        *--p = digit_pairs[pair];
+    }
+    if (v >= 10) {
+        *--p = digit_pairs[v * 2 + 1];
+        *--p = digit_pairs[v * 2];
+    } else {
+        *--p = (char)('0' + v);
+    }
+    size_t k = (size_t)(tmp + sizeof(tmp) - p);
+    out_reserve(out, k);
+    memcpy(out->buf + out->len, p, k);
+    out->len += k;
+}
+
+static inline void out_int(struct outbuf *out, int v) {
+    if (v < 0) {
+        out_char(out, '-');
+        out_uint(out, -(uint32_t)v);
+    } else {
+        out_uint(out, (uint32_t)v);
+    }
+}
+
+/* Writes every row of the matrix, each prefixed with "<label> <i>: " */
+static void print_prefs(struct outbuf *out, const struct pref_matrix *m, const char *label) {
+    for (int i = 0; i < m->n; i++) {
+        out_str(out, label);
+        out_char(out, ' ');
+        out_uint(out, (uint32_t)i);
+        out_str(out, ": ");
+        if (m->width == 2) {
+            const uint16_t *row = (const uint16_t *)m->data + (size_t)i * m->n;
+            for (int j = 0; j < m->n; j++) {
+                out_uint(out, row[j]);
+                out_char(out, ' ');
+            }
+        } else {
+            const uint32_t *row = (const uint32_t *)m->data + (size_t)i * m->n;
+            for (int j = 0; j < m->n; j++) {
+                out_uint(out, row[j]);
+                out_char(out, ' ');
+            }
+        }
+        out_char(out, '\n');
+    }
+}
+
+/* Phases of a run, timed separately so it is clear where the time goes */
+enum phase {
+    PHASE_ALLOC,
+    PHASE_LOAD,
+    PHASE_GENERATE,
+    PHASE_RANK,
+    PHASE_SOLVE,
+    PHASE_RESOLVE,
+    PHASE_LATTICE,
+    PHASE_VERIFY,
+    PHASE_OUTPUT,
+    PHASE_COUNT
+};
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "alloc", "load", "generate", "rank", "solve", "resolve", "lattice", "verify", "output"
+};
+
+/* Accumulated nanoseconds per phase, measured on the monotonic clock */
+struct phase_timer {
+    uint64_t ns[PHASE_COUNT];
+    uint64_t started;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void timer_start(struct phase_timer *t) {
+    t->started = now_ns();
+}
+
+/* Charges the time since the last timer_start to phase p */
+static void timer_stop(struct phase_timer *t, enum phase p) {
+    t->ns[p] += now_ns() - t->started;
+}
+
+static uint64_t timer_total(const struct phase_timer *t) {
+    uint64_t total = 0;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        total += t->ns[p];
+    }
+    return total;
+}
+
+/* Format of the machine-readable timing report written to stderr */
+enum timing_format {
+    TIMING_NONE,
+    TIMING_JSON,  // one JSON object per run
+    TIMING_CSV    // a header line naming the columns, then one line of values
+};
+
+/* Describes the run that the timing report belongs to */
+struct run_info {
+    int n;
+    int width;
+    enum solver_mode mode;
+    enum schedule schedule;
+    int nthreads;
+    uint64_t seed;
+    uint64_t proposals;  // summed over trials in batch mode
+    uint64_t trials;
+    uint64_t wall_ns;    // elapsed time; with parallel trials, less than the phase total
+};
+
+static const char *mode_name(enum solver_mode mode) {
+    switch (mode) {
+    case SOLVER_SCAN: return "scan";
+    case SOLVER_RANK: return "rank";
+    case SOLVER_PIPELINED: return "pipelined";
+    default: return "parallel";
+    }
+}
+
+static const char *schedule_name(enum schedule schedule) {
+    switch (schedule) {
+    case SCHEDULE_ROUND_ROBIN: return "round-robin";
+    case SCHEDULE_LIFO: return "lifo";
+    default: return "fifo";
+    }
+}
+
+/* Peak resident set size of the process so far, in kilobytes */
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return usage.ru_maxrss;
+}
+
+/* Writes the per-phase timings of a run to stderr, as a single JSON line or as a
+   CSV header plus one row, so every run can be ingested by a dashboard */
+void report_timing(FILE *f, enum timing_format format, const struct run_info *run,
+                   const struct phase_timer *t) {
+    if (format == TIMING_JSON) {
+        fprintf(f, "{\"n\":%d,\"index_width\":%d,\"solver\":\"%s\",\"schedule\":\"%s\","
+                "\"threads\":%d,\"seed\":%llu,\"trials\":%llu,\"proposals\":%llu", run->n,
+                run->width * 8, mode_name(run->mode), schedule_name(run->schedule), run->nthreads,
+                (unsigned long long)run->seed, (unsigned long long)run->trials,
+                (unsigned long long)run->proposals);
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            fprintf(f, ",\"%s_ns\":%llu", phase_names[p], (unsigned long long)t->ns[p]);
+        }
+        fprintf(f, ",\"total_ns\":%llu,\"wall_ns\":%llu,\"peak_rss_kb\":%ld}\n",
+                (unsigned long long)timer_total(t), (unsigned long long)run->wall_ns, peak_rss_kb());
+    } else if (format == TIMING_CSV) {
+        fprintf(f, "n,index_width,solver,schedule,threads,seed,trials,proposals");
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            fprintf(f, ",%s_ns", phase_names[p]);
+        }
+        fprintf(f, ",total_ns,wall_ns,peak_rss_kb\n");
+        fprintf(f, "%d,%d,%s,%s,%d,%llu,%llu,%llu", run->n, run->width * 8, mode_name(run->mode),
+                schedule_name(run->schedule), run->nthreads, (unsigned long long)run->seed,
+                (unsigned long long)run->trials, (unsigned long long)run->proposals);
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            fprintf(f, ",%llu", (unsigned long long)t->ns[p]);
+        }
+        fprintf(f, ",%llu,%llu,%ld\n", (unsigned long long)timer_total(t), (unsigned long long)run->wall_ns,
+                peak_rss_kb());
+    }
+}
+
+static double megabytes(uint64_t bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+/* Prints the high-water mark of the tracked structures, broken down by what they
+   hold, and the peak resident set size of the whole process, which also counts
+   scratch buffers, mapped files, code and the C library */
+static void print_memory(void) {
+    struct mem_usage u;
+    mem_usage_get(&u);
+    printf("Memory: %.1f MB tracked at peak (preference lists %.1f, rank tables %.1f, match state %.1f, "
+           "other %.1f); peak RSS %.1f MB\n", megabytes(u.peak_total), megabytes(u.peak[MEM_PREFS]),
+           megabytes(u.peak[MEM_RANK]), megabytes(u.peak[MEM_MATCH]), megabytes(u.peak[MEM_OTHER]),
+           peak_rss_kb() / 1024.0);
+}
+
+/* Prints proposal statistics for a finished solve: the total against the
+   n * H(n) ~ n ln n expected on uniformly random instances, the most proposals any
+   seller made, a histogram of proposals per seller in power-of-two buckets, and the
+   hot-path counters if they were compiled in. All but the counters come from
+   seller_next_choices, so they cost nothing during the solve. */
+static void print_stats(const struct match_state *st) {
+    int n = st->n;
+    uint64_t proposals = count_proposals(st);
+    double expected = 0;
+    for (int i = 1; i <= n; i++) {
+        expected += (double)n / i;
+    }
+    int max_proposals = 0;
+    uint64_t histogram[32] = {0};  // bucket k counts sellers with 2^k..2^(k+1)-1 proposals
+    for (int i = 0; i < n; i++) {
+        int p = st->seller_next_choices[i];
+        if (p > max_proposals) {
+            max_proposals = p;
+        }
+        int k = 0;
+        while ((p >> (k + 1)) != 0) {
+            k++;
+        }
+        histogram[k]++;
+    }
+    printf("Proposals: %llu (%.2f x the expected n H(n) = %.0f for random lists)\n",
+           (unsigned long long)proposals, proposals / expected, expected);
+    printf("Most proposals by one seller: %d\n", max_proposals);
+    printf("Proposals per seller:\n");
+    for (int k = 0; k < 32; k++) {
+        if (histogram[k] != 0) {
+            printf("  %10d - %-10d %llu\n", 1 << k, (int)((2u << k) - 1), (unsigned long long)histogram[k]);
+        }
+    }
+#ifdef SM_STATS
+    printf("Counted proposals: %llu\n", (unsigned long long)st->counters.proposals);
+    printf("Rejections: %llu\n", (unsigned long long)st->counters.rejections);
+    printf("Engagements broken: %llu\n", (unsigned long long)st->counters.engagements_broken);
+    printf("Rounds: %llu\n", (unsigned long long)st->counters.rounds);
+#endif
+}
+
+/* Running totals over batch trials. Ranks count from 0 for a first choice. */
+struct trial_stats {
+    uint64_t trials;
+    double proposals;           // sums over trials of each trial's value
+    double proposals_squared;
+    double seller_rank;         // mean over sellers of their partner's position on their list
+    double buyer_rank;          // mean over buyers of their partner's position on their list
+    uint64_t min_proposals;
+    uint64_t max_proposals;
+};
+
+/* Adds a finished solve to the totals. A seller's partner is the last buyer they
+   proposed to, so their rank is seller_next_choices - 1; buyer_final_prefs holds
+   the buyers' ranks directly. */
+static void trial_stats_add(struct trial_stats *ts, const struct match_state *st) {
+    uint64_t proposals = count_proposals(st);
+    uint64_t buyer_ranks = (uint64_t)sum_ints(st->buyer_final_prefs, st->n);
+    if (ts->trials == 0 || proposals < ts->min_proposals) {
+        ts->min_proposals = proposals;
+    }
+    if (proposals > ts->max_proposals) {
+        ts->max_proposals = proposals;
+    }
+    ts->trials++;
+    ts->proposals += proposals;
+    ts->proposals_squared += (double)proposals * proposals;
+    ts->seller_rank += (double)(proposals - st->n) / st->n;
+    ts->buyer_rank += (double)buyer_ranks / st->n;
+}
+
+static void print_trial_stats(const struct trial_stats *ts, int n) {
+    double k = ts->trials;
+    double mean = ts->proposals / k;
+    double variance = ts->trials > 1 ? (ts->proposals_squared - k * mean * mean) / (k - 1) : 0;
+    printf("Trials: %llu, n = %d\n", (unsigned long long)ts->trials, n);
+    printf("Mean proposals: %.2f (sd %.2f, min %llu, max %llu)\n", mean,
+           sqrt(variance > 0 ? variance : 0), (unsigned long long)ts->min_proposals,
+           (unsigned long long)ts->max_proposals);
+    printf("Mean seller rank of partner: %.4f\n", ts->seller_rank / k);
+    printf("Mean buyer rank of partner: %.4f\n", ts->buyer_rank / k);
+}
+
+static void usage(void) {
+    printf("Usage: ./sm [options] <value for n>\n"
+           "       ./sm [options] --load FILE\n"
+           "       ./sm [options] --load-text FILE\n"
+           "       ./sm [--solver S] [--schedule S] [--threads N] [--verify] --serve [--socket PATH]\n"
+           "Options: [--solver scan|rank|parallel|pipelined] [--schedule round-robin|lifo|fifo]\n"
+           "         [--proposer sellers|buyers|both] [--perturb K]\n"
+           "         [--list-length L] [--buyers M] [--capacity C] [--lazy]\n"
+           "         [--family uniform|identical|master|popularity|adversarial|correlated]\n"
+           "         [--mem-limit SIZE[K|M|G|T]]\n"
+           "         [--index-width auto|16|32] [--seed S] [--threads N]\n"
+           "         [--timing json|csv|none] [--stats] [--no-prefs] [--verify]\n"
+           "         [--save FILE] [--skip-checksum] [--trials K]\n"
+           "         [--checkpoint FILE] [--checkpoint-interval SECONDS] [--resume FILE]\n"
+           "         [--enumerate K] [--egalitarian] [--nodes P] [--mpi]\n");
+    exit(1);
+}
+
+/* Command line settings */
+struct options {
+    enum solver_mode mode;
+    enum schedule schedule;
+    enum proposer proposer;
+    int width;  // 0 picks the narrowest width that fits n
+    uint64_t seed;
+    int nthreads;
+    enum timing_format timing;
+    bool stats;
+    bool print_pref_lists;
+    const char *load_path;
+    const char *load_text_path;
+    const char *save_path;
+    bool verify_checksum;
+    bool verify;
+    int trials;  // 0 for a single run that prints its matching
+    int perturb;  // rows to change and re-solve incrementally after the first solve
+    int list_length;  // for a sparse instance, buyers each seller ranks; 0 for all
+    int buyers;       // for a sparse instance, number of buyers; 0 for as many as sellers
+    int capacity;     // sellers each buyer can hold; 0 for one-to-one matching
+    bool lazy;        // compute a random instance's lists on demand instead of storing them
+    const struct instance_generator *generator;  // how to generate the instance
+    uint64_t mem_limit;  // bytes the tracked structures may take; 0 for no limit
+    const char *checkpoint_path;  // snapshot the solve here every checkpoint_interval
+    double checkpoint_interval;   // seconds
+    const char *resume_path;      // snapshot to take the solve up from
+    bool enumerate;             // list stable matchings from the rotation poset
+    uint64_t enumerate_limit;   // how many; 0 for all of them
+    bool egalitarian;           // find the stable matching with the least rank sum
+    bool serve;                 // answer requests instead of solving one instance
+    const char *socket_path;    // where to listen for them; standard input if NULL
+    int nodes;                  // solve distributed over this many nodes, as threads; 0 for not
+    bool mpi;                   // solve distributed over the processes of an MPI job
+};
+
+static void parse_options(int argc, char **argv, struct options *opts) {
+    static const struct option long_options[] = {
+        {"solver", required_argument, NULL, 's'},
+        {"schedule", required_argument, NULL, 'o'},
+        {"index-width", required_argument, NULL, 'w'},
+        {"seed", required_argument, NULL, 'r'},
+        {"threads", required_argument, NULL, 't'},
+        {"timing", required_argument, NULL, 'T'},
+        {"stats", no_argument, NULL, 'S'},
+        {"no-prefs", no_argument, NULL, 'P'},
+        {"load", required_argument, NULL, 'l'},
+        {"load-text", required_argument, NULL, 'L'},
+        {"save", required_argument, NULL, 'W'},
+        {"skip-checksum", no_argument, NULL, 'K'},
+        {"verify", no_argument, NULL, 'V'},
+        {"trials", required_argument, NULL, 'k'},
+        {"proposer", required_argument, NULL, 'p'},
+        {"perturb", required_argument, NULL, 'x'},
+        {"list-length", required_argument, NULL, 'e'},
+        {"buyers", required_argument, NULL, 'b'},
+        {"capacity", required_argument, NULL, 'c'},
+        {"family", required_argument, NULL, 'f'},
+        {"mem-limit", required_argument, NULL, 'm'},
+        {"lazy", no_argument, NULL, 'z'},
+        {"checkpoint", required_argument, NULL, 'C'},
+        {"checkpoint-interval", required_argument, NULL, 'I'},
+        {"resume", required_argument, NULL, 'R'},
+        {"enumerate", required_argument, NULL, 'E'},
+        {"egalitarian", no_argument, NULL, 'g'},
+        {"serve", no_argument, NULL, 'Y'},
+        {"socket", required_argument, NULL, 'U'},
+        {"nodes", required_argument, NULL, 'N'},
+        {"mpi", no_argument, NULL, 'M'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:o:w:r:t:T:SPl:L:W:KVk:p:x:e:b:c:zf:m:C:I:R:E:gYU:N:M", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            if (strcmp(optarg, "scan") == 0) {
+                opts->mode = SOLVER_SCAN;
+            } else if (strcmp(optarg, "rank") == 0) {
+                opts->mode = SOLVER_RANK;
+            } else if (strcmp(optarg, "parallel") == 0) {
+                opts->mode = SOLVER_PARALLEL;
+            } else if (strcmp(optarg, "pipelined") == 0) {
+                opts->mode = SOLVER_PIPELINED;
+            } else {
+                usage();
+            }
+            break;
+        case 'o':
+            if (strcmp(optarg, "round-robin") == 0) {
+                opts->schedule = SCHEDULE_ROUND_ROBIN;
+            } else if (strcmp(optarg, "lifo") == 0) {
+                opts->schedule = SCHEDULE_LIFO;
+            } else if (strcmp(optarg, "fifo") == 0) {
+                opts->schedule = SCHEDULE_FIFO;
+            } else {
+                usage();
+            }
+            break;
+        case 'e':
+            opts->list_length = atoi(optarg);
+            if (opts->list_length < 1) {
+                usage();
+            }
+            break;
+        case 'b':
+            opts->buyers = atoi(optarg);
+            if (opts->buyers < 1) {
+                usage();
+            }
+            break;
+        case 'c':
+            opts->capacity = atoi(optarg);
+            if (opts->capacity < 1) {
+                usage();
+            }
+            break;
+        case 'z':
+            opts->lazy = true;
+            break;
+        case 'f':
+            opts->generator = find_generator(optarg);
+            if (opts->generator == NULL) {
+                usage();
+            }
+            break;
+        case 'x':
+            opts->perturb = atoi(optarg);
+            if (opts->perturb < 1) {
+                usage();
+            }
+            break;
+        case 'p':
+            if (strcmp(optarg, "sellers") == 0) {
+                opts->proposer = PROPOSER_SELLERS;
+            } else if (strcmp(optarg, "buyers") == 0) {
+                opts->proposer = PROPOSER_BUYERS;
+            } else if (strcmp(optarg, "both") == 0) {
+                opts->proposer = PROPOSER_BOTH;
+            } else {
+                usage();
+            }
+            break;
+        case 'w':
+            if (strcmp(optarg, "auto") == 0) {
+                opts->width = 0;
+            } else if (strcmp(optarg, "16") == 0) {
+                opts->width = 2;
+            } else if (strcmp(optarg, "32") == 0) {
+                opts->width = 4;
+            } else {
+                usage();
+            }
+            break;
+        case 'r':
+            opts->seed = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            opts->nthreads = atoi(optarg);
+            if (opts->nthreads < 1) {
+                usage();
+            }
+            break;
+        case 'T':
+            if (strcmp(optarg, "json") == 0) {
+                opts->timing = TIMING_JSON;
+            } else if (strcmp(optarg, "csv") == 0) {
+                opts->timing = TIMING_CSV;
+            } else if (strcmp(optarg, "none") == 0) {
+                opts->timing = TIMING_NONE;
+            } else {
+                usage();
+            }
+            break;
+        case 'S':
+            opts->stats = true;
+            break;
+        case 'P':
+            opts->print_pref_lists = false;
+            break;
+        case 'l':
+            opts->load_path = optarg;
+            break;
+        case 'L':
+            opts->load_text_path = optarg;
+            break;
+        case 'W':
+            opts->save_path = optarg;
+            break;
+        case 'K':
+            opts->verify_checksum = false;
+            break;
+        case 'C':
+            opts->checkpoint_path = optarg;
+            break;
+        case 'I': {
+            char *end;
+            opts->checkpoint_interval = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || !(opts->checkpoint_interval > 0)) {
+                usage();
+            }
+            break;
+        }
+        case 'R':
+            opts->resume_path = optarg;
+            break;
+        case 'E': {
+            char *end;
+            opts->enumerate_limit = strtoull(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || optarg[0] == '-') {
+                usage();
+            }
+            opts->enumerate = true;
+            break;
+        }
+        case 'g':
+            opts->egalitarian = true;
+            break;
+        case 'Y':
+            opts->serve = true;
+            break;
+        case 'U':
+            opts->socket_path = optarg;
+            opts->serve = true;
+            break;
+        case 'N':
+            opts->nodes = atoi(optarg);
+            if (opts->nodes < 1) {
+                usage();
+            }
+            break;
+        case 'M':
+            opts->mpi = true;
+            break;
+        case 'V':
+            opts->verify = true;
+            break;
+        case 'm': {
+            char *end;
+            double limit = strtod(optarg, &end);
+            double scale = 1;
+            if (*end == 'K' || *end == 'k') {
+                scale = 1024.0;
+            } else if (*end == 'M' || *end == 'm') {
+                scale = 1024.0 * 1024;
+            } else if (*end == 'G' || *end == 'g') {
+                scale = 1024.0 * 1024 * 1024;
+            } else if (*end == 'T' || *end == 't') {
+                scale = 1024.0 * 1024 * 1024 * 1024;
+            }
+            if (scale != 1) {
+                end++;
+            }
+            if (end == optarg || *end != '\0' || !(limit * scale >= 1)) {
+                usage();
+            }
+            opts->mem_limit = (uint64_t)(limit * scale);
+            break;
+        }
+        case 'k':
+            opts->trials = atoi(optarg);
+            if (opts->trials < 1) {
+                usage();
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+}
+
+/* Reads n from the command line and settles the index width for it */
+static int parse_n(int argc, char **argv, struct options *opts) {
+    if (optind != argc - 1) { // need exactly one value for n
+        usage();
+    }
+    int n = atoi(argv[optind]);
+    if (n <= 0) {
+        usage();
+    }
+    if (opts->width == 0) {
+        opts->width = index_width_for(n);
+    } else if (opts->width < index_width_for(n)) {
+        fprintf(stderr, "n = %d does not fit in 16-bit indices\n", n);
+        exit(1);
+    }
+    return n;
+}
+
+/* Batch trials are spread over a pool of workers, each with its own workspace,
+   statistics and timers, so nothing is shared while solving. Every worker starts
+   with an equal slice of the trial numbers and takes them from the front; a worker
+   that runs dry steals the back half of another's remaining slice. A slice is a
+   single atomic word, so taking and stealing are both one compare-and-swap. */
+struct trial_worker {
+    alignas(64) _Atomic uint64_t range;  // next trial in the high 32 bits, end in the low
+    struct sm_context ctx;
+    struct trial_stats stats;
+    struct phase_timer timer;
+    struct trial_pool *pool;
+    int id;
+};
+
+struct trial_pool {
+    const struct options *opts;
+    int n;
+    int nworkers;
+    struct trial_worker *workers;
+    atomic_bool failed;  // a trial failed verification; everyone stops
+};
+
+static uint64_t pack_range(uint32_t begin, uint32_t end) {
+    return (uint64_t)begin << 32 | end;
+}
+
+/* Claims the next trial from w's own slice. Returns -1 if it is empty. */
+static int take_trial(struct trial_worker *w) {
+    uint64_t r = atomic_load(&w->range);
+    for (;;) {
+        uint32_t begin = (uint32_t)(r >> 32), end = (uint32_t)r;
+        if (begin >= end) {
+            return -1;
+        }
+        if (atomic_compare_exchange_weak(&w->range, &r, pack_range(begin + 1, end))) {
+            return (int)begin;
+        }
+    }
+}
+
+/* Moves the back half of some other worker's slice into w's. Returns false once
+   every slice is empty. Work only ever moves between slices, so this is safe to
+   call concurrently with other thieves and owners. */
+static bool steal_trials(struct trial_worker *w) {
+    struct trial_pool *pool = w->pool;
+    for (int k = 1; k < pool->nworkers; k++) {
+        struct trial_worker *victim = &pool->workers[(w->id + k) % pool->nworkers];
+        uint64_t r = atomic_load(&victim->range);
+        for (;;) {
+            uint32_t begin = (uint32_t)(r >> 32), end = (uint32_t)r;
+            if (begin >= end) {
+                break;
+            }
+            uint32_t mid = end - (end - begin + 1) / 2;
+            if (atomic_compare_exchange_weak(&victim->range, &r, pack_range(begin, mid))) {
+                atomic_store(&w->range, pack_range(mid, end));
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void run_one_trial(struct trial_worker *w, int t) {
+    const struct options *opts = w->pool->opts;
+    struct sm_context *ctx = &w->ctx;
+    timer_start(&w->timer);
+    sm_generate_with(ctx, opts->generator, w->pool->n, opts->seed + t, 1);
+    timer_stop(&w->timer, PHASE_GENERATE);
+    if (ctx->inst.buyer_rank.data != NULL) {
+        timer_start(&w->timer);
+        sm_build_rank_table(ctx, 1);
+        timer_stop(&w->timer, PHASE_RANK);
+    }
+    timer_start(&w->timer);
+    sm_solve(ctx, opts->mode, opts->schedule, 1);
+    timer_stop(&w->timer, PHASE_SOLVE);
+    if (opts->verify) {
+        timer_start(&w->timer);
+        bool ok = sm_verify(ctx, 1) == 1;
+        timer_stop(&w->timer, PHASE_VERIFY);
+        if (!ok) {
+            fprintf(stderr, "Trial %d (seed %llu) failed verification\n", t,
+                    (unsigned long long)(opts->seed + t));
+            atomic_store(&w->pool->failed, true);
+        }
+    }
+    trial_stats_add(&w->stats, &ctx->st);
+}
+
+static void *trial_worker_main(void *arg) {
+    struct trial_worker *w = arg;
+    timer_start(&w->timer);
+    if (sm_init(&w->ctx, w->pool->n, w->pool->opts->width,
+                needs_rank_table(w->pool->opts->mode) || w->pool->opts->verify) != 0) {
+        fprintf(stderr, "Out of memory allocating a solver context for n = %d\n", w->pool->n);
         exit(1);
-    } else if (argc == 2) {
-        n = atoi(argv[1]);
-    } 
-    /* Initialize arrays to store preferences, intermediate matches, and final results */
-	int seller_prefs[n][n];  // ith row is ith seller's preference list
-	int buyer_prefs[n][n]; 
-	int seller_next_choices[n];  // ith entry is ith seller's next choice of buyer 
-	int buyer_final_prefs[n];   // for verification - ith entry is the ith buyer's ranking
-	int seller_matches[n];  // ith entry is ith seller's matched buyer 
-	int buyer_matches[n];   
-
-    // Create array of numbers 1 to n to randomly shuffle to make each preference list 
-    int randlist[n];
+    }
+    timer_stop(&w->timer, PHASE_ALLOC);
+    while (!atomic_load_explicit(&w->pool->failed, memory_order_relaxed)) {
+        int t = take_trial(w);
+        if (t < 0) {
+            if (!steal_trials(w)) {
+                break;
+            }
+            continue;
+        }
+        run_one_trial(w, t);
+    }
+    sm_free(&w->ctx);
+    return NULL;
+}
+
+/* Folds one worker's totals into another's */
+static void trial_stats_merge(struct trial_stats *into, const struct trial_stats *from) {
+    if (from->trials == 0) {
+        return;
+    }
+    if (into->trials == 0 || from->min_proposals < into->min_proposals) {
+        into->min_proposals = from->min_proposals;
+    }
+    if (from->max_proposals > into->max_proposals) {
+        into->max_proposals = from->max_proposals;
+    }
+    into->trials += from->trials;
+    into->proposals += from->proposals;
+    into->proposals_squared += from->proposals_squared;
+    into->seller_rank += from->seller_rank;
+    into->buyer_rank += from->buyer_rank;
+}
+
+/* Batch mode: solves opts->trials random instances of size n, spread across
+   opts->nthreads workers that each allocate one workspace up front, then prints
+   aggregate statistics. Trial t uses seed + t whichever worker runs it, so results
+   do not depend on the thread count and any single trial can be rerun on its own
+   with --seed. */
+static int run_trials(int n, const struct options *opts) {
+    uint64_t wall_start = now_ns();
+    int nworkers = opts->nthreads < opts->trials ? opts->nthreads : opts->trials;
+    struct trial_pool pool = { .opts = opts, .n = n, .nworkers = nworkers };
+    atomic_init(&pool.failed, false);
+    pool.workers = alloc_array(nworkers, sizeof(struct trial_worker), "trial workers");
+    for (int i = 0; i < nworkers; i++) {
+        struct trial_worker *w = &pool.workers[i];
+        memset(w, 0, sizeof(*w));
+        w->pool = &pool;
+        w->id = i;
+        uint32_t begin = (uint32_t)((uint64_t)opts->trials * i / nworkers);
+        uint32_t end = (uint32_t)((uint64_t)opts->trials * (i + 1) / nworkers);
+        atomic_init(&w->range, pack_range(begin, end));
+    }
+    pthread_t *threads = alloc_array(nworkers, sizeof(pthread_t), "thread handles");
+    int started = 1;
+    for (; started < nworkers; started++) {
+        if (pthread_create(&threads[started], NULL, trial_worker_main, &pool.workers[started]) != 0) {
+            break;  // the running workers will steal the trials of the ones that did not start
+        }
+    }
+    trial_worker_main(&pool.workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    /* Merge the workers' statistics and timers now that they have all finished */
+    struct trial_stats ts = {0};
+    struct phase_timer timer = {0};
+    for (int i = 0; i < nworkers; i++) {
+        trial_stats_merge(&ts, &pool.workers[i].stats);
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            timer.ns[p] += pool.workers[i].timer.ns[p];
+        }
+    }
+    free(pool.workers);
+    uint64_t wall = now_ns() - wall_start;
+
+    print_trial_stats(&ts, n);
+    printf("Seeds: %llu to %llu\n", (unsigned long long)opts->seed,
+           (unsigned long long)(opts->seed + opts->trials - 1));
+    printf("Time per trial: %.6f seconds of thread time (solve %.6f)\n",
+           timer_total(&timer) / 1e9 / ts.trials, timer.ns[PHASE_SOLVE] / 1e9 / ts.trials);
+    printf("Wall time: %.6f seconds on %d threads\n", wall / 1e9, nworkers);
+    print_memory();
+    struct run_info run = { n, opts->width, opts->mode, opts->schedule, nworkers,
+                            opts->seed, (uint64_t)ts.proposals, ts.trials, wall };
+    report_timing(stderr, opts->timing, &run, &timer);
+    return atomic_load(&pool.failed) ? 2 : 0;
+}
+
+/* Writes every row of one side of a sparse instance, each prefixed with
+   "<label> <i>: " */
+static void print_sparse_side(struct outbuf *out, const struct sparse_side *side, const char *label) {
+    for (int i = 0; i < side->n; i++) {
+        out_str(out, label);
+        out_char(out, ' ');
+        out_uint(out, (uint32_t)i);
+        out_str(out, ": ");
+        for (size_t k = side->offsets[i]; k < side->offsets[i + 1]; k++) {
+            out_uint(out, side->lists[k]);
+            out_char(out, ' ');
+        }
+        out_char(out, '\n');
+    }
+}
+
+/* Sparse mode: solves a random instance of n sellers and --buyers buyers in which
+   each seller ranks --list-length of the buyers, stored in memory proportional to
+   the total list length. Sellers who run out of list, and buyers nobody ends up
+   with, stay unmatched and are printed with a match of -1. */
+static int run_sparse(int n, const struct options *opts) {
+    int nbuyers = opts->buyers > 0 ? opts->buyers : n;
+    int length = opts->list_length > 0 ? opts->list_length : nbuyers;
+    struct phase_timer timer = {0};
+    struct sparse_instance inst;
+    timer_start(&timer);
+    sparse_generate(&inst, n, nbuyers, length, opts->seed, opts->nthreads);
+    timer_stop(&timer, PHASE_GENERATE);
+
+    timer_start(&timer);
+    struct match_state st;
+    sparse_state_alloc(&st, &inst);
+    timer_stop(&timer, PHASE_ALLOC);
+
+    timer_start(&timer);
+    sparse_solve(&inst, &st);
+    timer_stop(&timer, PHASE_SOLVE);
+
+    bool verified = true;
+    if (opts->verify) {
+        timer_start(&timer);
+        verified = sparse_verify(&inst, &st, opts->nthreads);
+        timer_stop(&timer, PHASE_VERIFY);
+    }
+
+    timer_start(&timer);
+    struct outbuf *out = alloc_array(1, sizeof(struct outbuf), "output buffer");
+    out->f = stdout;
+    out->len = 0;
+    if (opts->print_pref_lists) {
+        out_str(out, "Pref lists - sellers\n");
+        print_sparse_side(out, &inst.sellers, "seller");
+        out_str(out, "Pref lists - buyers\n");
+        print_sparse_side(out, &inst.buyers, "buyer");
+    }
+    out_str(out, "Matches, ordered by both proposers and receivers.\n");
+    int matched = 0;
     for (int i = 0; i < n; i++) {
-        randlist[i] = i;
+        out_str(out, "seller ");
+        out_int(out, i);
+        out_str(out, " with buyer ");
+        out_int(out, st.seller_matches[i]);
+        out_str(out, ";    ");
+        matched += st.seller_matches[i] >= 0;
     }
-    // Create random seller's and buyer's preference lists
+    out_char(out, '\n');
+    out_flush(out);
+    free(out);
+    fflush(stdout);
+    timer_stop(&timer, PHASE_OUTPUT);
+
+    printf("Seed: %llu\n", (unsigned long long)opts->seed);
+    printf("Matched pairs: %d (%d sellers and %d buyers unmatched)\n", matched, n - matched,
+           nbuyers - matched);
+    printf("Solve time: %.6f seconds\n", timer.ns[PHASE_SOLVE] / 1e9);
+    if (opts->verify) {
+        printf("Verification: %s (%.6f seconds)\n", verified ? "stable" : "FAILED",
+               timer.ns[PHASE_VERIFY] / 1e9);
+    }
+    printf("Time taken: %.6f seconds\n", timer_total(&timer) / 1e9);
+    print_memory();
+    struct run_info run = { n, 4, SOLVER_RANK, SCHEDULE_LIFO, opts->nthreads, opts->seed,
+                            count_proposals(&st), 1, timer_total(&timer) };
+    report_timing(stderr, opts->timing, &run, &timer);
+
+    sparse_state_free(&st, &inst);
+    sparse_free(&inst);
+    return verified ? 0 : 2;
+}
+
+/* Lazy mode: solves a random instance whose lists are computed as the solve reads
+   them, so memory is O(n) and the whole run O(n log n) on average. The lists are
+   never stored, so they are not printed. */
+static int run_lazy(int n, const struct options *opts) {
+    struct phase_timer timer = {0};
+    struct lazy_instance inst;
+    lazy_init(&inst, n, opts->seed);
+    timer_start(&timer);
+    struct match_state st;
+    match_state_alloc(&st, n);
+    timer_stop(&timer, PHASE_ALLOC);
+
+    timer_start(&timer);
+    lazy_solve(&inst, &st);
+    timer_stop(&timer, PHASE_SOLVE);
+
+    bool verified = true;
+    if (opts->verify) {
+        timer_start(&timer);
+        verified = lazy_verify(&inst, &st, opts->nthreads);
+        timer_stop(&timer, PHASE_VERIFY);
+    }
+
+    timer_start(&timer);
+    struct outbuf *out = alloc_array(1, sizeof(struct outbuf), "output buffer");
+    out->f = stdout;
+    out->len = 0;
+    out_str(out, "Matches, ordered by both proposers and receivers.\n");
     for (int i = 0; i < n; i++) {
-        shuffle_array(randlist, n);
-        for (int j = 0; j < n; j++) {
-            seller_prefs[i][j] = randlist[j];
+        out_str(out, "seller ");
+        out_int(out, i);
+        out_str(out, " with buyer ");
+        out_int(out, st.seller_matches[i]);
+        out_str(out, ";    ");
+    }
+    out_char(out, '\n');
+    out_flush(out);
+    free(out);
+    fflush(stdout);
+    timer_stop(&timer, PHASE_OUTPUT);
+
+    printf("Seed: %llu\n", (unsigned long long)opts->seed);
+    printf("Solve time: %.6f seconds\n", timer.ns[PHASE_SOLVE] / 1e9);
+    if (opts->verify) {
+        printf("Verification: %s (%.6f seconds)\n", verified ? "stable" : "FAILED",
+               timer.ns[PHASE_VERIFY] / 1e9);
+    }
+    printf("Time taken: %.6f seconds\n", timer_total(&timer) / 1e9);
+    print_memory();
+    if (opts->stats) {
+        print_stats(&st);
+    }
+    struct run_info run = { n, 4, SOLVER_RANK, SCHEDULE_LIFO, opts->nthreads, opts->seed,
+                            count_proposals(&st), 1, timer_total(&timer) };
+    report_timing(stderr, opts->timing, &run, &timer);
+    match_state_free(&st);
+    return verified ? 0 : 2;
+}
+
+/* Distributed mode: the instance is split into blocks of sellers and buyers, one
+   per node, and solved in rounds of batched messages between them. The nodes are
+   threads of this process with --nodes, or the processes of an MPI job with --mpi.
+   Node 0 gathers the matching and prints it, and the report, in the same form as
+   a single solve, so the two can be compared. */
+struct node_run {
+    const struct options *opts;
+    int n;
+    const struct instance *whole;  // loaded instance the nodes take their blocks of, or NULL to generate them
+    int nthreads;                  // per node, for building its block
+    struct phase_timer timer;      // node 0's
+    atomic_bool failed;            // set by every node if verification fails
+};
+
+static void node_main(struct transport *t, void *arg) {
+    struct node_run *run = arg;
+    const struct options *opts = run->opts;
+    int n = run->n;
+    struct phase_timer own = {0};
+    struct phase_timer *timer = t->rank == 0 ? &run->timer : &own;
+    struct node_instance inst;
+    timer_start(timer);
+    if (run->whole != NULL) {
+        node_attach(&inst, run->whole, t, run->nthreads);
+        timer_stop(timer, PHASE_RANK);
+    } else {
+        node_generate(&inst, n, opts->width, opts->seed, t, run->nthreads);
+        timer_stop(timer, PHASE_GENERATE);
+    }
+    timer_start(timer);
+    struct match_state st;
+    node_state_alloc(&st, &inst);
+    timer_stop(timer, PHASE_ALLOC);
+
+    timer_start(timer);
+    struct distributed_stats stats;
+    distributed_solve(&inst, &st, t, &stats);
+    timer_stop(timer, PHASE_SOLVE);
+
+    bool verified = true;
+    if (opts->verify) {
+        timer_start(timer);
+        verified = distributed_verify(&inst, &st, t);
+        timer_stop(timer, PHASE_VERIFY);
+        if (!verified) {
+            atomic_store(&run->failed, true);
         }
-        shuffle_array(randlist, n);
-        for (int j = 0; j < n; j++) {
-            buyer_prefs[i][j] = randlist[j];
+    }
+
+    timer_start(timer);
+    int *matches = t->rank == 0 ? alloc_array(n, sizeof(int), "gathered matches") : NULL;
+    distributed_gather(&inst, &st, t, matches);
+    if (t->rank == 0) {
+        struct outbuf *out = alloc_array(1, sizeof(struct outbuf), "output buffer");
+        out->f = stdout;
+        out->len = 0;
+        out_str(out, "Matches, ordered by both proposers and receivers.\n");
+        for (int i = 0; i < n; i++) {
+            out_str(out, "seller ");
+            out_int(out, i);
+            out_str(out, " with buyer ");
+            out_int(out, matches[i]);
+            out_str(out, ";    ");
         }
+        out_char(out, '\n');
+        out_flush(out);
+        free(out);
+        fflush(stdout);
     }
-    // All sellers' next proposals are to their favorite buyers, since we haven't started
-    // yet. No matches have been made, so initialize buyer_final_prefs and the match 
-    // array entries to -1
-    for (int i = 0; i < n; i++) {
-        seller_next_choices[i] = 0;
-        buyer_final_prefs[i] = -1;
-        seller_matches[i] = -1; 
-        buyer_matches[i] = -1;
-    }
-
-    /* Initialize variables for execution */
-    int bachelor_count = n; // Number of unmatched sellers. We terminate when we get this to 0
-    int curr_buyer = -1;    // ID # of buyer being proposed to 
-    // Variables below used when comparing two competing sellers  
-    int curr_seller_rank = -1;  // Rank of current seller on current buyer's pref list
-    int other_seller = -1;  // ID # of seller already matched to buyer being proposed to
-    int other_seller_rank = -1;  
-    
-    while(bachelor_count > 0) {
-        for (int curr_seller = 0; curr_seller < n; curr_seller++) {   
-            if (seller_matches[curr_seller] == -1) {    // For each unmatched seller, ... 
-                curr_buyer = seller_prefs[curr_seller][seller_next_choices[curr_seller]];  // Get buyer to propose to next
-                seller_next_choices[curr_seller]++;  // Update next buyer to propose to, if seller not matched this round 
-                other_seller = buyer_matches[curr_buyer];   // if no competing seller, is -1
-                // Get current seller's rank on this buyer's pref list
-	            for (int j = 0; j < n; j++) {
-	                if (buyer_prefs[curr_buyer][j] == curr_seller) {
-	                    curr_seller_rank = j;
-	                }
-	            }
-	
-                /* No competing seller matched to this buyer already, so match this buyer
-                   and seller. First, find current buyer's ranking of current seller and 
-                   record; then, record the matching and decrease bachelor count.  */
-                if (other_seller == -1) {  
-	                buyer_final_prefs[curr_buyer] = curr_seller_rank;
-                    buyer_matches[curr_buyer] = curr_seller;
-                    seller_matches[curr_seller] = curr_buyer;
-                    bachelor_count--;
-                } else {    
-                /* There is a competing seller. If current seller is ranked higher than
-                   competitor, assign as new match to this buyer, and make former matched
-                   seller open again  */
-                    other_seller_rank = buyer_final_prefs[curr_buyer];
-                    if (curr_seller_rank < other_seller_rank) {
-                        buyer_final_prefs[curr_buyer] = curr_seller_rank;
-                        buyer_matches[curr_buyer] = curr_seller;
-                        seller_matches[curr_seller] = curr_buyer;
-                        seller_matches[other_seller] = -1;
-                    }
+    timer_stop(timer, PHASE_OUTPUT);
+
+    if (t->rank == 0) {
+        if (run->whole == NULL) {
+            printf("Seed: %llu\n", (unsigned long long)opts->seed);
+        }
+        printf("Nodes: %d %s, %llu rounds, %llu proposals, %llu messages between nodes\n", t->size,
+               opts->mpi ? "MPI processes" : "threads", (unsigned long long)stats.rounds,
+               (unsigned long long)stats.proposals, (unsigned long long)stats.messages);
+        printf("Solve time: %.6f seconds\n", timer->ns[PHASE_SOLVE] / 1e9);
+        if (opts->verify) {
+            printf("Verification: %s (%.6f seconds)\n", verified ? "stable" : "FAILED",
+                   timer->ns[PHASE_VERIFY] / 1e9);
+        }
+        printf("Time taken: %.6f seconds\n", timer_total(timer) / 1e9);
+        print_memory();
+        struct run_info info = { n, inst.width, SOLVER_RANK, SCHEDULE_LIFO, opts->nthreads, opts->seed,
+                                 stats.proposals, 1, timer_total(timer) };
+        report_timing(stderr, opts->timing, &info, timer);
+    }
+    free(matches);
+    node_state_free(&st);
+    node_instance_free(&inst);
+}
+
+static int run_distributed(int argc, char **argv, struct options *opts) {
+    struct node_run run = { .opts = opts };
+    atomic_init(&run.failed, false);
+    struct instance whole;
+    if (opts->load_path != NULL) {
+        if (optind != argc) {
+            usage();
+        }
+        timer_start(&run.timer);
+        instance_load(&whole, opts->load_path, opts->verify_checksum);
+        timer_stop(&run.timer, PHASE_LOAD);
+        run.whole = &whole;
+        run.n = whole.n;
+        opts->width = whole.width;
+    } else {
+        run.n = parse_n(argc, argv, opts);
+    }
+    if (opts->mpi) {
+#ifdef SM_MPI
+        struct transport t;
+        mpi_transport_init(&t, &argc, &argv);
+        run.nthreads = opts->nthreads;
+        node_main(&t, &run);
+        mpi_transport_finish(&t);
+#endif
+    } else {
+        // The nodes already have a thread each
+        run.nthreads = 1;
+        run_thread_nodes(opts->nodes, node_main, &run);
+    }
+    if (run.whole != NULL) {
+        instance_free(&whole);
+    }
+    return atomic_load(&run.failed) ? 2 : 0;
+}
+
+/* Prints each stable matching --enumerate lists on a line of its own */
+struct matching_list {
+    struct outbuf *out;
+    int n;
+    uint64_t count;
+};
+
+static bool print_stable_matching(void *arg, const int *matches, int64_t seller_cost, int64_t buyer_cost) {
+    struct matching_list *list = arg;
+    struct outbuf *out = list->out;
+    char label[96];
+    snprintf(label, sizeof(label), "%llu (seller ranks %lld, buyer ranks %lld):",
+             (unsigned long long)++list->count, (long long)seller_cost, (long long)buyer_cost);
+    out_str(out, label);
+    for (int s = 0; s < list->n; s++) {
+        out_char(out, ' ');
+        out_int(out, matches[s]);
+    }
+    out_char(out, '\n');
+    return true;
+}
+
+/* One proposing side's solve, run on its own thread when both sides propose */
+struct side_solve {
+    const struct instance *inst;  // the instance itself, or its mirror for buyers proposing
+    const struct options *opts;
+    int nthreads;
+    struct match_state st;
+    struct buyer_heaps *heaps;    // buyers' holders, for many-to-one matching only
+};
+
+static void *side_solve_main(void *arg) {
+    struct side_solve *side = arg;
+    if (side->heaps != NULL) {
+        solve_capacitated(side->inst, &side->st, side->heaps);
+    } else {
+        run_solver(side->inst, side->opts->mode, side->opts->schedule, side->nthreads, &side->st);
+    }
+    return NULL;
+}
+
+/* Server mode. Requests and responses are frames in host byte order, the same as
+   instance files, each a fixed header followed by length bytes of payload:
+
+     request:  "SMRQ", version 1, id, n, index width (2 or 4), length, then the
+               sellers' and the buyers' n x n lists, row-major
+     response: "SMRS", status, id, n, proposals, length, then each seller's buyer
+               as n 32-bit ids (nothing unless the status is SERVE_SOLVED)
+
+   Responses carry their request's id and may come back out of order. Requests are
+   read on one thread per connection and queued; each worker takes a batch of
+   queued requests at a time, solves them one after another in its own warm
+   context, and writes the batch's responses with one write per connection. */
+#define SERVE_REQUEST_MAGIC "SMRQ"
+#define SERVE_RESPONSE_MAGIC "SMRS"
+#define SERVE_VERSION 1
+
+/* Requests a worker takes at once, up to SERVE_BATCH_ENTRIES list entries in all,
+   so small instances share the cost of each queue operation and write */
+#define SERVE_BATCH 64
+#define SERVE_BATCH_ENTRIES (1 << 20)
+
+/* Requests read but not yet taken, beyond which readers wait */
+#define SERVE_QUEUE 1024
+
+/* Largest n a request may have */
+#define SERVE_MAX_N 65535
+
+enum serve_status {
+    SERVE_SOLVED,
+    SERVE_BAD_LISTS,     // a row is not a permutation of 0..n-1
+    SERVE_BAD_REQUEST,   // the header is invalid; the connection is closed after this
+    SERVE_NO_MEMORY,
+    SERVE_UNSTABLE       // the matching failed --verify
+};
+
+struct serve_request_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t id;
+    uint32_t n;
+    uint32_t index_width;
+    uint64_t length;  // 2 * n * n * index_width
+};
+
+struct serve_response_header {
+    char magic[4];
+    uint32_t status;
+    uint64_t id;
+    uint32_t n;
+    uint32_t reserved;
+    uint64_t proposals;
+    uint64_t length;  // 4 * n when solved, otherwise 0
+};
+
+/* A client: requests come in on in and responses go out on out, which may be the
+   same socket. It is closed and freed when its reader has stopped and every request
+   it queued has been answered. */
+struct serve_connection {
+    FILE *in;
+    int out;
+    bool owns_out;
+    pthread_mutex_t write_lock;
+    bool broken;               // a write failed; drop further responses
+    atomic_int refs;           // the reader plus each request in flight
+};
+
+struct serve_request {
+    struct serve_connection *conn;
+    struct serve_request_header h;
+    void *lists;
+    enum serve_status status;  // SERVE_SOLVED unless the reader already failed it
+};
+
+struct serve_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct serve_request *items[SERVE_QUEUE];
+    int head;
+    int count;
+    bool closed;
+};
+
+struct serve_worker {
+    struct serve_queue *queue;
+    const struct options *opts;
+    struct sm_context ctx;
+    bool have_ctx;
+    char *out;                 // responses waiting to be written, all to out_conn
+    size_t out_len;
+    size_t out_capacity;
+    struct serve_connection *out_conn;
+};
+
+static atomic_ullong serve_solved;
+static atomic_ullong serve_failed;
+
+static void serve_release(struct serve_connection *conn) {
+    if (atomic_fetch_sub(&conn->refs, 1) == 1) {
+        fclose(conn->in);
+        if (conn->owns_out) {
+            close(conn->out);
+        }
+        pthread_mutex_destroy(&conn->write_lock);
+        free(conn);
+    }
+}
+
+static void serve_queue_push(struct serve_queue *q, struct serve_request *req) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == SERVE_QUEUE) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->items[(q->head + q->count++) % SERVE_QUEUE] = req;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Takes up to SERVE_BATCH requests, waiting for at least one. Returns 0 once the
+   queue is closed and empty. */
+static int serve_queue_take(struct serve_queue *q, struct serve_request **batch) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    int taken = 0;
+    uint64_t entries = 0;
+    while (q->count > 0 && taken < SERVE_BATCH && entries < SERVE_BATCH_ENTRIES) {
+        struct serve_request *req = q->items[q->head];
+        q->head = (q->head + 1) % SERVE_QUEUE;
+        q->count--;
+        batch[taken++] = req;
+        entries += (uint64_t)req->h.n * req->h.n;
+    }
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return taken;
+}
+
+static void serve_queue_close(struct serve_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Writes the worker's pending responses to their connection */
+static void serve_flush(struct serve_worker *w) {
+    struct serve_connection *conn = w->out_conn;
+    if (conn == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&conn->write_lock);
+    size_t done = 0;
+    while (!conn->broken && done < w->out_len) {
+        ssize_t wrote = write(conn->out, w->out + done, w->out_len - done);
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wrote <= 0) {
+            conn->broken = true;
+            break;
+        }
+        done += (size_t)wrote;
+    }
+    pthread_mutex_unlock(&conn->write_lock);
+    w->out_len = 0;
+    w->out_conn = NULL;
+}
+
+static void serve_append(struct serve_worker *w, const void *data, size_t size) {
+    if (w->out_len + size > w->out_capacity) {
+        size_t capacity = w->out_capacity > 0 ? w->out_capacity : 1 << 16;
+        while (capacity < w->out_len + size) {
+            capacity *= 2;
+        }
+        char *out = realloc(w->out, capacity);
+        if (out == NULL) {
+            fprintf(stderr, "Out of memory buffering responses\n");
+            exit(1);
+        }
+        w->out = out;
+        w->out_capacity = capacity;
+    }
+    memcpy(w->out + w->out_len, data, size);
+    w->out_len += size;
+}
+
+/* Makes sure the worker's context can hold n a side, growing it to at least
+   double its old capacity so a rising run of sizes does not regrow every time */
+static bool serve_reserve(struct serve_worker *w, int n) {
+    if (w->have_ctx && n <= w->ctx.capacity) {
+        return true;
+    }
+    int capacity = n;
+    if (w->have_ctx) {
+        capacity = 2 * w->ctx.capacity > n ? 2 * w->ctx.capacity : n;
+        capacity = capacity < SERVE_MAX_N ? capacity : SERVE_MAX_N;
+        sm_free(&w->ctx);
+    }
+    w->have_ctx = sm_init(&w->ctx, capacity, 0, needs_rank_table(w->opts->mode) || w->opts->verify) == 0;
+    if (!w->have_ctx && capacity > n) {
+        w->have_ctx = sm_init(&w->ctx, n, 0, needs_rank_table(w->opts->mode) || w->opts->verify) == 0;
+    }
+    return w->have_ctx;
+}
+
+static void serve_solve(struct serve_worker *w, struct serve_request *req) {
+    int n = (int)req->h.n;
+    enum serve_status status = req->status;
+    if (status == SERVE_SOLVED && !serve_reserve(w, n)) {
+        status = SERVE_NO_MEMORY;
+    }
+    if (status == SERVE_SOLVED) {
+        size_t matrix = (size_t)n * n * req->h.index_width;
+        if (sm_load_lists(&w->ctx, n, (int)req->h.index_width, req->lists, (char *)req->lists + matrix) != 0) {
+            status = SERVE_BAD_LISTS;
+        } else {
+            sm_solve(&w->ctx, w->opts->mode, w->opts->schedule, 1);
+            if (w->opts->verify && sm_verify(&w->ctx, 1) != 1) {
+                status = SERVE_UNSTABLE;
+            }
+        }
+    }
+    free(req->lists);
+
+    if (w->out_conn != req->conn) {
+        serve_flush(w);
+        w->out_conn = req->conn;
+    }
+    struct serve_response_header r = {0};
+    memcpy(r.magic, SERVE_RESPONSE_MAGIC, sizeof(r.magic));
+    r.status = status;
+    r.id = req->h.id;
+    if (status == SERVE_SOLVED) {
+        r.n = (uint32_t)n;
+        r.proposals = count_proposals(&w->ctx.st);
+        r.length = 4 * (uint64_t)n;
+    }
+    serve_append(w, &r, sizeof(r));
+    if (status == SERVE_SOLVED) {
+        serve_append(w, w->ctx.st.seller_matches, (size_t)n * sizeof(int));
+    }
+    atomic_fetch_add(status == SERVE_SOLVED ? &serve_solved : &serve_failed, 1);
+}
+
+static void *serve_worker_main(void *arg) {
+    struct serve_worker *w = arg;
+    struct serve_request *batch[SERVE_BATCH];
+    int taken;
+    while ((taken = serve_queue_take(w->queue, batch)) > 0) {
+        for (int i = 0; i < taken; i++) {
+            serve_solve(w, batch[i]);
+        }
+        serve_flush(w);
+        for (int i = 0; i < taken; i++) {
+            serve_release(batch[i]->conn);
+            free(batch[i]);
+        }
+    }
+    if (w->have_ctx) {
+        sm_free(&w->ctx);
+    }
+    free(w->out);
+    return NULL;
+}
+
+/* Reads requests from conn and queues them until the input ends or a header is
+   invalid; an invalid one is queued as a failure and ends the connection, since
+   the frames after it cannot be found */
+struct serve_reader {
+    struct serve_queue *queue;
+    struct serve_connection *conn;
+};
+
+static void *serve_reader_main(void *arg) {
+    struct serve_reader *r = arg;
+    struct serve_connection *conn = r->conn;
+    for (;;) {
+        struct serve_request *req = malloc(sizeof(*req));
+        if (req == NULL || fread(&req->h, sizeof(req->h), 1, conn->in) != 1) {
+            free(req);
+            break;
+        }
+        req->conn = conn;
+        req->lists = NULL;
+        req->status = SERVE_SOLVED;
+        struct serve_request_header *h = &req->h;
+        if (memcmp(h->magic, SERVE_REQUEST_MAGIC, sizeof(h->magic)) != 0 || h->version != SERVE_VERSION
+            || h->n < 1 || h->n > SERVE_MAX_N || (h->index_width != 2 && h->index_width != 4)
+            || h->length != 2 * (uint64_t)h->n * h->n * h->index_width) {
+            req->status = SERVE_BAD_REQUEST;
+        } else if ((req->lists = malloc(h->length)) == NULL) {
+            req->status = SERVE_NO_MEMORY;
+        }
+        if (req->status == SERVE_NO_MEMORY) {
+            /* Skip the payload, so the next frame can still be read */
+            char skip[4096];
+            uint64_t left = h->length;
+            while (left > 0) {
+                size_t k = left < sizeof(skip) ? (size_t)left : sizeof(skip);
+                if (fread(skip, 1, k, conn->in) != k) {
+                    break;
                 }
-            } // if bachelor is unmatched make a proposal
-        } // for each bachelor, 
-    } // while there are still bachelors
+                left -= k;
+            }
+        } else if (req->status == SERVE_SOLVED && fread(req->lists, 1, h->length, conn->in) != h->length) {
+            free(req->lists);
+            free(req);
+            break;
+        }
+        atomic_fetch_add(&conn->refs, 1);
+        serve_queue_push(r->queue, req);
+        if (req->status == SERVE_BAD_REQUEST) {
+            break;
+        }
+    }
+    serve_release(conn);
+    free(r);
+    return NULL;
+}
+
+static struct serve_connection *serve_connect(int in, int out, bool owns_out) {
+    struct serve_connection *conn = alloc_array(1, sizeof(*conn), "connection");
+    conn->in = fdopen(in, "rb");
+    if (conn->in == NULL) {
+        fprintf(stderr, "Cannot read requests: %s\n", strerror(errno));
+        exit(1);
+    }
+    setvbuf(conn->in, NULL, _IOFBF, 1 << 16);
+    conn->out = out;
+    conn->owns_out = owns_out;
+    conn->broken = false;
+    pthread_mutex_init(&conn->write_lock, NULL);
+    atomic_init(&conn->refs, 1);
+    return conn;
+}
+
+/* Serves requests on standard input, answering on standard output, until the
+   input ends; or with socket_path, serves every client that connects to a Unix
+   socket there, without end. Workers run on opts->nthreads threads. */
+static int run_server(const struct options *opts, const char *socket_path) {
+    signal(SIGPIPE, SIG_IGN);
+    struct serve_queue queue = { .count = 0 };
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+    pthread_cond_init(&queue.not_full, NULL);
+    int nworkers = opts->nthreads;
+    struct serve_worker *workers = alloc_array(nworkers, sizeof(*workers), "server workers");
+    pthread_t *threads = alloc_array(nworkers, sizeof(*threads), "server workers");
+    for (int i = 0; i < nworkers; i++) {
+        workers[i] = (struct serve_worker){ .queue = &queue, .opts = opts };
+        if (pthread_create(&threads[i], NULL, serve_worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "Cannot start server worker %d\n", i);
+            exit(1);
+        }
+    }
+    uint64_t started = now_ns();
+
+    if (socket_path == NULL) {
+        struct serve_reader *r = alloc_array(1, sizeof(*r), "connection reader");
+        *r = (struct serve_reader){ &queue, serve_connect(STDIN_FILENO, STDOUT_FILENO, false) };
+        serve_reader_main(r);
+        serve_queue_close(&queue);
+        for (int i = 0; i < nworkers; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double seconds = (now_ns() - started) / 1e9;
+        unsigned long long solved = atomic_load(&serve_solved);
+        fprintf(stderr, "Served %llu requests (%llu failed) in %.6f seconds, %.0f per second\n",
+                solved + atomic_load(&serve_failed), (unsigned long long)atomic_load(&serve_failed), seconds,
+                seconds > 0 ? solved / seconds : 0);
+        free(workers);
+        free(threads);
+        return 0;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socket_path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, socket_path);
+    struct stat sb;
+    if (stat(socket_path, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+        unlink(socket_path);  // left over from an earlier server
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        exit(1);
+    }
+    fprintf(stderr, "Serving on %s with %d workers\n", socket_path, nworkers);
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);  // wait for clients to leave
+                continue;
+            }
+            fprintf(stderr, "Cannot accept connections on %s: %s\n", socket_path, strerror(errno));
+            exit(1);
+        }
+        int out = dup(fd);
+        struct serve_reader *r = malloc(sizeof(*r));
+        pthread_t reader;
+        if (out < 0 || r == NULL) {
+            close(fd);
+            if (out >= 0) {
+                close(out);
+            }
+            free(r);
+            continue;
+        }
+        *r = (struct serve_reader){ &queue, serve_connect(fd, out, true) };
+        if (pthread_create(&reader, NULL, serve_reader_main, r) != 0) {
+            serve_release(r->conn);
+            free(r);
+            continue;
+        }
+        pthread_detach(reader);
+    }
+}
+
+/* Bytes a run on a stored n x n instance will charge: both sides' lists, the rank
+   tables that solving, verifying and re-solving need, a match state per proposing
+   side, and any buyer heaps. Batch trials instead give each worker a context
+   sized for one seller-proposing solve. */
+static uint64_t stored_footprint(int n, int width, const struct options *opts) {
+    bool rank = needs_rank_table(opts->mode) || opts->verify || opts->enumerate || opts->egalitarian;
+    if (opts->trials > 0) {
+        int nworkers = opts->nthreads < opts->trials ? opts->nthreads : opts->trials;
+        return nworkers * dense_footprint(n, width, rank, 1);
+    }
+    bool sellers_propose = opts->proposer != PROPOSER_BUYERS;
+    bool buyers_propose = opts->proposer != PROPOSER_SELLERS;
+    int rank_tables = ((sellers_propose && rank) || opts->perturb > 0)
+                      + ((buyers_propose && rank) || opts->perturb > 0);
+    uint64_t bytes = dense_footprint(n, width, rank_tables, sellers_propose + buyers_propose);
+    if (opts->capacity > 0) {
+        bytes += buyer_heaps_footprint(n, (uint64_t)n * opts->capacity);
+    }
+    if (opts->checkpoint_path != NULL) {
+        bytes += (5 * (uint64_t)n + 1) * sizeof(int);  // the snapshot buffer
+    }
+    return bytes;
+}
+
+/* With --mem-limit, checks that the run will fit in the budget before anything is
+   allocated. A stored instance that would not fit falls back first to the narrowest
+   index width, then, if the run only needs what it offers, to a lazy instance;
+   sparse and lazy instances have a size of their own and are only checked. Exits
+   if nothing fits. */
+static void fit_memory(int n, struct options *opts) {
+    uint64_t need;
+    if (opts->list_length > 0 || opts->buyers > 0) {
+        int nbuyers = opts->buyers > 0 ? opts->buyers : n;
+        int length = opts->list_length > 0 && opts->list_length < nbuyers ? opts->list_length : nbuyers;
+        need = sparse_footprint(n, nbuyers, length);
+    } else if (opts->lazy) {
+        need = lazy_footprint(n);
+    } else if (opts->nodes > 0) {
+        need = opts->nodes * node_footprint(n, opts->width, opts->nodes);
+    } else {
+        need = stored_footprint(n, opts->width, opts);
+        if (need > opts->mem_limit && opts->width > index_width_for(n)) {
+            opts->width = index_width_for(n);
+            need = stored_footprint(n, opts->width, opts);
+            fprintf(stderr, "--mem-limit: using %d-bit indices\n", opts->width * 8);
+        }
+        if (need > opts->mem_limit && opts->generator == find_generator("uniform") && opts->trials == 0
+            && opts->proposer == PROPOSER_SELLERS && opts->perturb == 0 && opts->capacity == 0
+            && opts->save_path == NULL) {
+            fprintf(stderr, "--mem-limit: a stored instance needs %.1f MB, so generating it lazily "
+                    "(a different instance for the same seed)\n", megabytes(need));
+            opts->lazy = true;
+            need = lazy_footprint(n);
+        }
+    }
+    if (need > opts->mem_limit) {
+        fprintf(stderr, "This run needs %.1f MB, over the --mem-limit of %.1f MB\n", megabytes(need),
+                megabytes(opts->mem_limit));
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv) {
+    /* Record time we started execution, the default seed */
+    time_t start_time = time(NULL);
+
+    /* Parse options, then the input value for n */
+    struct options opts = {
+        .mode = SOLVER_RANK,
+        .schedule = SCHEDULE_LIFO,
+        .seed = (uint64_t)start_time,
+        .nthreads = 1,
+        .timing = TIMING_NONE,
+        .print_pref_lists = true,
+        .verify_checksum = true,
+        .checkpoint_interval = 600,
+    };
+    parse_options(argc, argv, &opts);
+    if (opts.serve) {
+        if (optind != argc || opts.load_path != NULL || opts.load_text_path != NULL || opts.save_path != NULL
+            || opts.trials > 0 || opts.lazy || opts.list_length > 0 || opts.buyers > 0 || opts.perturb > 0
+            || opts.capacity > 0 || opts.proposer != PROPOSER_SELLERS || opts.generator != NULL
+            || opts.mem_limit > 0 || opts.checkpoint_path != NULL || opts.resume_path != NULL
+            || opts.enumerate || opts.egalitarian) {
+            fprintf(stderr, "--serve solves the instances it is sent, with sellers proposing, and takes "
+                    "only --solver, --schedule, --threads and --verify\n");
+            exit(1);
+        }
+        if (opts.mode == SOLVER_PARALLEL) {
+            fprintf(stderr, "--serve solves each instance on one worker thread, so not with --solver parallel\n");
+            exit(1);
+        }
+        return run_server(&opts, opts.socket_path);
+    }
+    if (opts.checkpoint_path != NULL || opts.resume_path != NULL) {
+        if (opts.mode != SOLVER_RANK || opts.schedule != SCHEDULE_LIFO || opts.proposer != PROPOSER_SELLERS
+            || opts.perturb > 0 || opts.capacity > 0 || opts.trials > 0 || opts.lazy
+            || opts.list_length > 0 || opts.buyers > 0) {
+            fprintf(stderr, "--checkpoint and --resume work with the rank solver, the lifo schedule "
+                    "and sellers proposing, on one stored one-to-one instance\n");
+            exit(1);
+        }
+        if (opts.resume_path != NULL && opts.load_path == NULL) {
+            fprintf(stderr, "--resume takes up a solve of an instance file, which --load must give\n");
+            exit(1);
+        }
+        if (opts.checkpoint_path != NULL && opts.load_path == NULL && opts.save_path == NULL) {
+            fprintf(stderr, "--checkpoint needs an instance file to resume against, from --load or --save\n");
+            exit(1);
+        }
+    }
+    if (opts.enumerate || opts.egalitarian) {
+        if (opts.capacity > 0 || opts.perturb > 0 || opts.trials > 0 || opts.lazy || opts.list_length > 0
+            || opts.buyers > 0 || opts.checkpoint_path != NULL || opts.resume_path != NULL) {
+            fprintf(stderr, "--enumerate and --egalitarian work on one stored one-to-one instance, "
+                    "solved from scratch\n");
+            exit(1);
+        }
+        /* The rotations lead from the seller-optimal matching to the buyer-optimal one */
+        opts.proposer = PROPOSER_BOTH;
+    }
+    if (opts.nodes > 0 || opts.mpi) {
+        if (opts.nodes > 0 && opts.mpi) {
+            fprintf(stderr, "--nodes runs the nodes as threads and --mpi as MPI processes, so not both\n");
+            exit(1);
+        }
+#ifndef SM_MPI
+        if (opts.mpi) {
+            fprintf(stderr, "--mpi needs the MPI build of the solver, made by make sm-mpi\n");
+            exit(1);
+        }
+#endif
+        if (opts.load_text_path != NULL || opts.save_path != NULL || opts.trials > 0 || opts.lazy
+            || opts.list_length > 0 || opts.buyers > 0 || opts.perturb > 0 || opts.capacity > 0
+            || opts.proposer != PROPOSER_SELLERS || opts.generator != NULL || opts.checkpoint_path != NULL
+            || opts.resume_path != NULL || opts.enumerate || opts.egalitarian || opts.stats
+            || opts.mode != SOLVER_RANK || opts.schedule != SCHEDULE_LIFO || (opts.mpi && opts.mem_limit > 0)) {
+            fprintf(stderr, "--nodes and --mpi solve a uniformly random instance or an instance file with "
+                    "sellers proposing, and take only --seed, --index-width, --load, --skip-checksum, "
+                    "--threads, --verify, --timing and, with --nodes, --mem-limit\n");
+            exit(1);
+        }
+    }
+    if (opts.generator != NULL && (opts.load_path != NULL || opts.load_text_path != NULL
+                                   || opts.lazy || opts.list_length > 0 || opts.buyers > 0)) {
+        fprintf(stderr, "--family only applies to generated complete instances that are stored\n");
+        exit(1);
+    }
+    if (opts.generator == NULL) {
+        opts.generator = find_generator("uniform");
+    }
+    if (opts.mem_limit > 0) {
+        if (opts.load_path != NULL || opts.load_text_path != NULL) {
+            fprintf(stderr, "--mem-limit plans generated instances; a loaded one has the size of its file\n");
+            exit(1);
+        }
+        fit_memory(parse_n(argc, argv, &opts), &opts);
+    }
+    if (opts.nodes > 0 || opts.mpi) {
+        return run_distributed(argc, argv, &opts);
+    }
+    if (opts.trials > 0) {
+        if (opts.load_path != NULL || opts.load_text_path != NULL || opts.save_path != NULL) {
+            fprintf(stderr, "--trials generates its own instances and cannot load or save them\n");
+            exit(1);
+        }
+        if (opts.proposer != PROPOSER_SELLERS || opts.perturb > 0) {
+            fprintf(stderr, "--trials only runs seller-proposing solves from scratch\n");
+            exit(1);
+        }
+        if (opts.capacity > 0 || opts.lazy) {
+            fprintf(stderr, "--trials only runs one-to-one matching on stored instances\n");
+            exit(1);
+        }
+        int n = parse_n(argc, argv, &opts);
+        return run_trials(n, &opts);
+    }
+    if (opts.lazy) {
+        if (opts.load_path != NULL || opts.load_text_path != NULL || opts.save_path != NULL
+            || opts.proposer != PROPOSER_SELLERS || opts.perturb > 0 || opts.capacity > 0
+            || opts.list_length > 0 || opts.buyers > 0) {
+            fprintf(stderr, "--lazy generates complete random lists on demand, and is only "
+                    "solved with sellers proposing, from scratch\n");
+            exit(1);
+        }
+        opts.width = 4;
+        int n = parse_n(argc, argv, &opts);
+        return run_lazy(n, &opts);
+    }
+    if (opts.list_length > 0 || opts.buyers > 0) {
+        if (opts.load_path != NULL || opts.load_text_path != NULL || opts.save_path != NULL
+            || opts.proposer != PROPOSER_SELLERS || opts.perturb > 0 || opts.capacity > 0) {
+            fprintf(stderr, "--list-length and --buyers generate a sparse instance, which is only "
+                    "solved with sellers proposing, from scratch\n");
+            exit(1);
+        }
+        opts.width = 4;
+        int n = parse_n(argc, argv, &opts);
+        return run_sparse(n, &opts);
+    }
+
+    struct phase_timer timer = {0};
+    struct instance inst;
+    int n;
+    if (opts.load_path != NULL) {
+        /* Solve the instance in the given file, which fixes n and the index width */
+        if (optind != argc) {
+            usage();
+        }
+        timer_start(&timer);
+        instance_load(&inst, opts.load_path, opts.verify_checksum);
+        timer_stop(&timer, PHASE_LOAD);
+        n = inst.n;
+        opts.width = inst.width;
+    } else if (opts.load_text_path != NULL) {
+        if (optind != argc) {
+            usage();
+        }
+        timer_start(&timer);
+        instance_load_text(&inst, opts.load_text_path, opts.width);
+        timer_stop(&timer, PHASE_LOAD);
+        n = inst.n;
+        opts.width = inst.width;
+    } else {
+        n = parse_n(argc, argv, &opts);
+        timer_start(&timer);
+        instance_alloc(&inst, n, opts.width);
+        timer_stop(&timer, PHASE_ALLOC);
+
+        // Create random seller's and buyer's preference lists
+        timer_start(&timer);
+        generate_with(&inst, opts.generator, opts.seed, opts.nthreads);
+        timer_stop(&timer, PHASE_GENERATE);
+    }
+    int width = opts.width;
+    if (opts.perturb > 0 && (inst.mapping != NULL || opts.proposer != PROPOSER_SELLERS)) {
+        fprintf(stderr, "--perturb changes the lists in place, so it needs a writable instance "
+                "and seller-proposing solves\n");
+        exit(1);
+    }
+    if (opts.capacity > 0 && (opts.mode != SOLVER_RANK || opts.proposer != PROPOSER_SELLERS
+                              || opts.perturb > 0)) {
+        fprintf(stderr, "--capacity works with the rank solver, sellers proposing, and no --perturb\n");
+        exit(1);
+    }
+    if (opts.save_path != NULL) {
+        inst.checksum = instance_save(&inst, opts.save_path);
+    }
+
+    /* Initialize arrays to store intermediate matches and final results, one set per
+       proposing side. All sellers' next proposals are to their favorite buyers, since
+       we haven't started yet, and no matches have been made. */
+    bool sellers_propose = opts.proposer != PROPOSER_BUYERS;
+    bool buyers_propose = opts.proposer != PROPOSER_SELLERS;
+    struct instance mirror;
+    struct side_solve sides[2] = {
+        [PROPOSER_SELLERS] = { .inst = &inst, .opts = &opts, .nthreads = opts.nthreads },
+        [PROPOSER_BUYERS] = { .inst = &mirror, .opts = &opts, .nthreads = opts.nthreads },
+    };
+    timer_start(&timer);
+    for (int side = 0; side < 2; side++) {
+        if (side == PROPOSER_SELLERS ? sellers_propose : buyers_propose) {
+            match_state_alloc(&sides[side].st, n);
+        }
+    }
+    /* With capacities, every buyer holds up to opts.capacity sellers in a heap */
+    int *capacities = NULL;
+    struct buyer_heaps heaps;
+    if (opts.capacity > 0) {
+        capacities = alloc_array(n, sizeof(int), "buyer capacities");
+        for (int b = 0; b < n; b++) {
+            capacities[b] = opts.capacity;
+        }
+        buyer_heaps_alloc(&heaps, n, capacities);
+        sides[PROPOSER_SELLERS].heaps = &heaps;
+    }
+    timer_stop(&timer, PHASE_ALLOC);
+
+    /* In rank mode, invert the receiving side's lists once so each proposal is O(1) */
+    if (needs_rank_table(opts.mode)) {
+        timer_start(&timer);
+        if (sellers_propose) {
+            pm_alloc(&inst.buyer_rank, n, width, MEM_RANK, "buyer rank table");
+        }
+        if (buyers_propose) {
+            pm_alloc(&inst.seller_rank, n, width, MEM_RANK, "seller rank table");
+        }
+        timer_stop(&timer, PHASE_ALLOC);
+        timer_start(&timer);
+        if (sellers_propose) {
+            build_rank_table(&inst, opts.nthreads);
+        }
+        if (buyers_propose) {
+            build_seller_rank_table(&inst, opts.nthreads);
+        }
+        timer_stop(&timer, PHASE_RANK);
+    }
+    instance_mirror(&inst, &mirror);
+
+    /* A resumed solve starts from the snapshot's state instead of from scratch */
+    int resume_top = -1;
+    uint64_t resumed_proposals = 0;
+    if (opts.resume_path != NULL) {
+        timer_start(&timer);
+        resume_top = snapshot_load(&sides[PROPOSER_SELLERS].st, opts.resume_path, inst.checksum);
+        resumed_proposals = count_proposals(&sides[PROPOSER_SELLERS].st);
+        timer_stop(&timer, PHASE_LOAD);
+    }
+
+    /* With both sides proposing, the buyers' solve runs on a thread of its own (with
+       half the parallel solver's threads) while this one solves for the sellers. The
+       two only read the shared preference storage. */
+    timer_start(&timer);
+    uint64_t snapshots = 0;
+    if (opts.checkpoint_path != NULL || opts.resume_path != NULL) {
+        struct checkpointer *ck = NULL;
+        if (opts.checkpoint_path != NULL) {
+            ck = checkpoint_start(opts.checkpoint_path, n, (uint64_t)(opts.checkpoint_interval * 1e9),
+                                  inst.checksum, opts.seed);
+        }
+        solve_checkpointed(&inst, &sides[PROPOSER_SELLERS].st, resume_top, ck);
+        if (ck != NULL) {
+            snapshots = checkpoint_stop(ck);
+        }
+    } else if (opts.proposer == PROPOSER_BOTH) {
+        sides[PROPOSER_BUYERS].nthreads = opts.nthreads > 1 ? opts.nthreads / 2 : 1;
+        sides[PROPOSER_SELLERS].nthreads = opts.nthreads > 1 ? opts.nthreads - opts.nthreads / 2 : 1;
+        pthread_t buyer_thread;
+        bool threaded = pthread_create(&buyer_thread, NULL, side_solve_main, &sides[PROPOSER_BUYERS]) == 0;
+        side_solve_main(&sides[PROPOSER_SELLERS]);
+        if (threaded) {
+            pthread_join(buyer_thread, NULL);
+        } else {
+            side_solve_main(&sides[PROPOSER_BUYERS]);
+        }
+    } else {
+        side_solve_main(&sides[opts.proposer]);
+    }
+    timer_stop(&timer, PHASE_SOLVE);
+
+    /* Change some rows, then repair the matching rather than solving again. The
+       repair works from both rank tables, whatever the solver. */
+    uint64_t resolve_work = 0;
+    if (opts.perturb > 0) {
+        timer_start(&timer);
+        if (inst.buyer_rank.data == NULL) {
+            pm_alloc(&inst.buyer_rank, n, width, MEM_RANK, "buyer rank table");
+            build_rank_table(&inst, opts.nthreads);
+        }
+        pm_alloc(&inst.seller_rank, n, width, MEM_RANK, "seller rank table");
+        build_seller_rank_table(&inst, opts.nthreads);
+        timer_stop(&timer, PHASE_RANK);
+        int *changed = alloc_array(2 * (size_t)opts.perturb, sizeof(int), "changed rows");
+        int nsellers, nbuyers;
+        perturb_rows(&inst, opts.seed, opts.perturb, changed, &nsellers, changed + opts.perturb, &nbuyers);
+        timer_start(&timer);
+        resolve_work = resolve_changed(&inst, &sides[PROPOSER_SELLERS].st, changed, nsellers,
+                                       changed + opts.perturb, nbuyers);
+        timer_stop(&timer, PHASE_RESOLVE);
+        free(changed);
+    }
+
+    /* Find the rotations between the two optimal matchings, and from them the
+       egalitarian matching. The walk needs both rank tables, which a scan-mode run
+       builds here. */
+    struct rotation_poset poset;
+    struct match_state egalitarian;
+    int64_t egalitarian_cost = 0;
+    if (opts.enumerate || opts.egalitarian) {
+        timer_start(&timer);
+        if (inst.buyer_rank.data == NULL) {
+            pm_alloc(&inst.buyer_rank, n, width, MEM_RANK, "buyer rank table");
+            build_rank_table(&inst, opts.nthreads);
+        }
+        if (inst.seller_rank.data == NULL) {
+            pm_alloc(&inst.seller_rank, n, width, MEM_RANK, "seller rank table");
+            build_seller_rank_table(&inst, opts.nthreads);
+        }
+        rotation_poset_build(&poset, &inst, sides[PROPOSER_SELLERS].st.seller_matches,
+                             sides[PROPOSER_BUYERS].st.buyer_matches);
+        if (opts.egalitarian) {
+            match_state_alloc(&egalitarian, n);
+            egalitarian_cost = egalitarian_matching(&poset, sides[PROPOSER_SELLERS].st.seller_matches,
+                                                    egalitarian.seller_matches);
+            for (int s = 0; s < n; s++) {
+                egalitarian.buyer_matches[egalitarian.seller_matches[s]] = s;
+            }
+        }
+        timer_stop(&timer, PHASE_LATTICE);
+    }
+
+    /* Prove the matchings are perfect and stable. The check needs the rank tables,
+       so a scan-mode run builds them here, as part of verification. A failure with
+       buyers proposing is reported in the mirrored view's terms, with the two sides'
+       names swapped. */
+    bool verified = true;
+    if (opts.verify) {
+        timer_start(&timer);
+        if (sellers_propose && inst.buyer_rank.data == NULL) {
+            pm_alloc(&inst.buyer_rank, n, width, MEM_RANK, "buyer rank table");
+            build_rank_table(&inst, opts.nthreads);
+        }
+        if (buyers_propose && inst.seller_rank.data == NULL) {
+            pm_alloc(&inst.seller_rank, n, width, MEM_RANK, "seller rank table");
+            build_seller_rank_table(&inst, opts.nthreads);
+        }
+        instance_mirror(&inst, &mirror);
+        for (int side = 0; side < 2; side++) {
+            if (side == PROPOSER_SELLERS ? sellers_propose : buyers_propose) {
+                verified = (sides[side].heaps != NULL
+                            ? verify_capacitated(sides[side].inst, &sides[side].st, sides[side].heaps, opts.nthreads)
+                            : verify_matching(sides[side].inst, &sides[side].st, opts.nthreads)) && verified;
+            }
+        }
+        if (opts.egalitarian) {
+            verified = verify_matching(&inst, &egalitarian, opts.nthreads) && verified;
+        }
+        timer_stop(&timer, PHASE_VERIFY);
+    }
 
     // Print pref lists and results
-    printf("Pref lists - sellers\n");
-    for (int i = 0; i < n; i++) {
-        printf("seller %d: ", i);
-        for (int j = 0; j < n; j++) {
-           printf("%d ", seller_prefs[i][j]); 
+    timer_start(&timer);
+    struct outbuf *out = alloc_array(1, sizeof(struct outbuf), "output buffer");
+    out->f = stdout;
+    out->len = 0;
+    if (opts.print_pref_lists) {
+        out_str(out, "Pref lists - sellers\n");
+        print_prefs(out, &inst.seller_prefs, "seller");
+        out_str(out, "Pref lists - buyers\n");
+        print_prefs(out, &inst.buyer_prefs, "buyer");
+    }
+    if (sellers_propose) {
+        out_str(out, "Matches, ordered by both proposers and receivers.\n");
+        for (int i = 0; i < n; i++) {
+            out_str(out, "seller ");
+            out_int(out, i);
+            out_str(out, " with buyer ");
+            out_int(out, sides[PROPOSER_SELLERS].st.seller_matches[i]);
+            out_str(out, ";    ");
         }
-        printf("\n");
+        out_char(out, '\n');
     }
-    printf("Pref lists - buyers\n");
-    for (int i = 0; i < n; i++) {
-        printf("buyer %d: ", i);
-        for (int j = 0; j < n; j++) {
-           printf("%d ", buyer_prefs[i][j]); 
+    if (buyers_propose) {
+        // In the mirrored view buyers are the proposers, so their matches are in seller_matches
+        out_str(out, "Matches with buyers proposing, ordered by both proposers and receivers.\n");
+        for (int i = 0; i < n; i++) {
+            out_str(out, "buyer ");
+            out_int(out, i);
+            out_str(out, " with seller ");
+            out_int(out, sides[PROPOSER_BUYERS].st.seller_matches[i]);
+            out_str(out, ";    ");
         }
-        printf("\n");
+        out_char(out, '\n');
     }
-    printf("Matches, ordered by both proposers and receivers.\n");
-    for (int i = 0; i < n; i++) {
-        printf("seller %d with buyer %d;    ", i, seller_matches[i]);
+    if (opts.egalitarian) {
+        out_str(out, "Egalitarian matching, ordered by both proposers and receivers.\n");
+        for (int i = 0; i < n; i++) {
+            out_str(out, "seller ");
+            out_int(out, i);
+            out_str(out, " with buyer ");
+            out_int(out, egalitarian.seller_matches[i]);
+            out_str(out, ";    ");
+        }
+        out_char(out, '\n');
+    }
+    /* Stable matchings are generated one at a time as they are printed */
+    uint64_t listed = 0;
+    bool listed_all = false;
+    if (opts.enumerate) {
+        out_str(out, "Stable matchings, each as the buyers of sellers 0 to n - 1 in turn.\n");
+        struct matching_list list = { out, n, 0 };
+        listed = stable_matchings(&poset, sides[PROPOSER_SELLERS].st.seller_matches, opts.enumerate_limit,
+                                  print_stable_matching, &list, &listed_all);
+    }
+    out_flush(out);
+    free(out);
+    fflush(stdout);
+    timer_stop(&timer, PHASE_OUTPUT);
+
+    if (opts.load_path == NULL && opts.load_text_path == NULL) {
+        printf("Seed: %llu\n", (unsigned long long)opts.seed);
+    }
+    printf("Rank table build time: %.6f seconds\n", timer.ns[PHASE_RANK] / 1e9);
+    printf("Solve time: %.6f seconds\n", timer.ns[PHASE_SOLVE] / 1e9);
+    if (opts.resume_path != NULL) {
+        printf("Resumed from %s with %d of %d sellers free, after %llu proposals\n", opts.resume_path,
+               resume_top, n, (unsigned long long)resumed_proposals);
+    }
+    if (opts.checkpoint_path != NULL) {
+        printf("Snapshots written to %s: %llu\n", opts.checkpoint_path, (unsigned long long)snapshots);
     }
-    printf("\n");
-        
-    printf("Time taken: %d seconds \n", time(NULL) - start_time);
-    return 0;
+    if (opts.capacity > 0) {
+        int full = 0;
+        for (int b = 0; b < n; b++) {
+            full += heaps.sizes[b] == capacities[b];
+        }
+        printf("Buyers at capacity %d: %d of %d\n", opts.capacity, full, n);
+        buyer_heaps_free(&heaps);
+        free(capacities);
+    }
+    if (opts.perturb > 0) {
+        printf("Re-solve time after changing %d rows: %.6f seconds (%llu proposals and repairs)\n",
+               opts.perturb, timer.ns[PHASE_RESOLVE] / 1e9, (unsigned long long)resolve_work);
+    }
+    if (opts.enumerate || opts.egalitarian) {
+        printf("Rotations: %d, with %zu precedence pairs (%.6f seconds)\n", poset.count,
+               poset.pred_offsets[poset.count], timer.ns[PHASE_LATTICE] / 1e9);
+        if (opts.enumerate) {
+            printf("Stable matchings listed: %llu%s\n", (unsigned long long)listed,
+                   listed_all ? " (all of them)" : "");
+        }
+        if (opts.egalitarian) {
+            int64_t seller_optimal = poset.seller_cost + poset.buyer_cost;
+            int64_t buyer_optimal = seller_optimal;
+            for (int r = 0; r < poset.count; r++) {
+                buyer_optimal += poset.seller_delta[r] + poset.buyer_delta[r];
+            }
+            printf("Egalitarian rank sum: %lld (seller-optimal %lld, buyer-optimal %lld)\n",
+                   (long long)egalitarian_cost, (long long)seller_optimal, (long long)buyer_optimal);
+            match_state_free(&egalitarian);
+        }
+        rotation_poset_free(&poset);
+    }
+    if (opts.verify) {
+        printf("Verification: %s (%.6f seconds)\n", verified ? "stable" : "FAILED",
+               timer.ns[PHASE_VERIFY] / 1e9);
+    }
+    printf("Time taken: %.6f seconds\n", timer_total(&timer) / 1e9);
+    print_memory();
+    uint64_t proposals = 0;
+    for (int side = 0; side < 2; side++) {
+        if (side == PROPOSER_SELLERS ? sellers_propose : buyers_propose) {
+            if (opts.stats) {
+                if (opts.proposer == PROPOSER_BOTH) {
+                    printf("%s proposing:\n", side == PROPOSER_SELLERS ? "Sellers" : "Buyers");
+                }
+                print_stats(&sides[side].st);
+            }
+            proposals += count_proposals(&sides[side].st);
+            match_state_free(&sides[side].st);
+        }
+    }
+    struct run_info run = { n, width, opts.mode, opts.schedule, opts.nthreads, opts.seed,
+                            proposals, 1, timer_total(&timer) };
+    report_timing(stderr, opts.timing, &run, &timer);
+
+    instance_free(&inst);
+    return verified ? 0 : 2;
 }
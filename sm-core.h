@@ -0,0 +1,917 @@
+/* Solver core, specialized by the width of the preference matrix entries.
+
+   This file is included once per supported width by sm.c, with IDX defined as the
+   unsigned type stored in the matrices and FN(name) expanding to the width-suffixed
+   name of each function (e.g. solve_u16). Code outside this file calls the right
+   instantiation through DISPATCH. */
+
+/* Row i of the matrix, e.g. the ith seller's preference list */
+static inline IDX *FN(row)(const struct pref_matrix *m, int i) {
+    return (IDX *)m->data + (size_t)i * m->n;
+}
+
+/* Copies a list of ids into row i of the matrix, narrowing them to IDX */
+static void FN(store_row)(struct pref_matrix *m, int i, const int *list) {
+    IDX *row = FN(row)(m, i);
+    for (int j = 0; j < m->n; j++) {
+        row[j] = (IDX)list[j];
+    }
+}
+
+/* Checks that a row of n entries is a permutation of 0..n-1, using seen as an
+   n-bit scratch bitset. Returns the position of the first out-of-range or repeated
+   entry, or -1 if the row is a permutation. */
+static int FN(check_permutation)(const IDX *row, int n, uint64_t *seen) {
+    memset(seen, 0, ((size_t)n + 63) / 64 * sizeof(uint64_t));
+    for (int j = 0; j < n; j++) {
+        uint32_t v = row[j];
+        if (v >= (uint32_t)n || (seen[v / 64] >> (v % 64) & 1) != 0) {
+            return j;
+        }
+        seen[v / 64] |= (uint64_t)1 << (v % 64);
+    }
+    return -1;
+}
+
+/* Copies n x n row-major lists of entries src_width bytes wide into m, checking
+   that every row is a permutation of 0..n-1 with seen as n bits of scratch. Returns
+   the first row that is not, or -1 if all are. */
+static int FN(copy_rows)(struct pref_matrix *m, const void *src, int src_width, uint64_t *seen) {
+    int n = m->n;
+    for (int i = 0; i < n; i++) {
+        IDX *row = FN(row)(m, i);
+        size_t base = (size_t)i * n;
+        for (int j = 0; j < n; j++) {
+            uint32_t v = src_width == 2 ? ((const uint16_t *)src)[base + j] : ((const uint32_t *)src)[base + j];
+            if (v >= (uint32_t)n) {
+                return i;
+            }
+            row[j] = (IDX)v;
+        }
+        if (FN(check_permutation)(row, n, seen) >= 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Checks that every row of m is a permutation of 0..n-1, with seen as n bits of
+   scratch. Returns the first row that is not, or -1 if all are. */
+static int FN(check_rows)(const struct pref_matrix *m, uint64_t *seen) {
+    for (int i = 0; i < m->n; i++) {
+        if (FN(check_permutation)(FN(row)(m, i), m->n, seen) >= 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* For making an array of integers 0 through n-1 in a random order: fills it in
+   order, then applies a Fisher-Yates shuffle driven by the given generator */
+static void FN(shuffle_array)(struct rng *rng, IDX *array, int n) {
+    for (int i = 0; i < n; i++) {
+        array[i] = (IDX)i;
+    }
+    for (int i = n - 1; i > 0; i--) {
+        int j = (int)rng_below(rng, (uint32_t)i + 1);
+        IDX t = array[j];
+        array[j] = array[i];
+        array[i] = t;
+    }
+}
+
+/* Replaces row i of the matrix with a fresh random permutation */
+static void FN(shuffle_row)(struct rng *rng, struct pref_matrix *m, int i) {
+    FN(shuffle_array)(rng, FN(row)(m, i), m->n);
+}
+
+/* Fills rows begin..end-1 of both sides' preference lists with uniformly random
+   permutations. Each row is shuffled in place from its own substream of seed, so it
+   depends only on the seed and the row, and any split of the rows across threads
+   produces the same instance. */
+static void FN(generate_rows)(struct instance *inst, uint64_t seed, int begin, int end) {
+    struct rng rng;
+    for (int i = begin; i < end; i++) {
+        rng_seed(&rng, seed, SELLER_STREAM(i));
+        FN(shuffle_array)(&rng, FN(row)(&inst->seller_prefs, i), inst->n);
+        rng_seed(&rng, seed, BUYER_STREAM(i));
+        FN(shuffle_array)(&rng, FN(row)(&inst->buyer_prefs, i), inst->n);
+    }
+}
+
+/* Fills row i of m from master, its side's shared list. With spread 0 the row is
+   master itself. Otherwise the entry at master position k is given the key
+   k + a random amount below spread, and the row lists the entries by key, ties in
+   master order: everyone roughly agrees on who is popular but differs locally.
+   keys (n entries) and counts (n + spread) are scratch. */
+static void FN(master_row)(struct rng *rng, struct pref_matrix *m, int i, const int *master, int spread,
+                           uint32_t *keys, int *counts) {
+    int n = m->n;
+    IDX *row = FN(row)(m, i);
+    if (spread == 0) {
+        for (int k = 0; k < n; k++) {
+            row[k] = (IDX)master[k];
+        }
+        return;
+    }
+    memset(counts, 0, ((size_t)n + spread) * sizeof(int));
+    for (int k = 0; k < n; k++) {
+        keys[k] = (uint32_t)k + rng_below(rng, (uint32_t)spread);
+        counts[keys[k]]++;
+    }
+    int total = 0;
+    for (int key = 0; key < n + spread; key++) {
+        int count = counts[key];
+        counts[key] = total;
+        total += count;
+    }
+    for (int k = 0; k < n; k++) {
+        row[counts[keys[k]]++] = (IDX)master[k];
+    }
+}
+
+/* Rows begin..end-1 of an instance built on master lists: side 0 (sellers) and
+   side 1 (buyers) each either shuffle every row, when spreads[side] is negative,
+   or derive every row from masters[side] as in master_row */
+static void FN(generate_master_rows)(struct instance *inst, uint64_t seed, const int *const *masters,
+                                     const int *spreads, uint32_t *keys, int *counts, int begin, int end) {
+    struct pref_matrix *sides[2] = { &inst->seller_prefs, &inst->buyer_prefs };
+    struct rng rng;
+    for (int i = begin; i < end; i++) {
+        for (int side = 0; side < 2; side++) {
+            rng_seed(&rng, seed, side == 0 ? SELLER_STREAM(i) : BUYER_STREAM(i));
+            if (spreads[side] < 0) {
+                FN(shuffle_row)(&rng, sides[side], i);
+            } else {
+                FN(master_row)(&rng, sides[side], i, masters[side], spreads[side], keys, counts);
+            }
+        }
+    }
+}
+
+/* Rows begin..end-1 of a correlated instance: each row ranks the other side by
+   their base score in scores plus noise drawn from the row's stream, lowest first.
+   keys is scratch for 2n sort entries. */
+static void FN(generate_correlated_rows)(struct instance *inst, uint64_t seed, const uint32_t *const *scores,
+                                         uint64_t *keys, int begin, int end) {
+    struct pref_matrix *sides[2] = { &inst->seller_prefs, &inst->buyer_prefs };
+    int n = inst->n;
+    struct rng rng;
+    for (int i = begin; i < end; i++) {
+        for (int side = 0; side < 2; side++) {
+            rng_seed(&rng, seed, side == 0 ? SELLER_STREAM(i) : BUYER_STREAM(i));
+            for (int j = 0; j < n; j++) {
+                uint64_t key = scores[side][j] + (rng_next(&rng) >> 34);
+                keys[j] = key << 32 | (uint32_t)j;
+            }
+            sort_keys(keys, keys + n, n);
+            IDX *row = FN(row)(sides[side], i);
+            for (int j = 0; j < n; j++) {
+                row[j] = (IDX)(uint32_t)keys[j];
+            }
+        }
+    }
+}
+
+/* Inverts buyers begin..end-1's preference list, so that buyer_rank[b][s] is the position of
+   seller s on buyer b's list. Costs one O(n^2) pass up front, after which comparing
+   two sellers is a pair of lookups instead of a search of the list. */
+static void FN(build_rank_rows)(const struct pref_matrix *buyer_prefs, struct pref_matrix *buyer_rank,
+                                int begin, int end) {
+    int n = buyer_prefs->n;
+    for (int b = begin; b < end; b++) {
+        const IDX *prefs = FN(row)(buyer_prefs, b);
+        IDX *rank = FN(row)(buyer_rank, b);
+        for (int j = 0; j < n; j++) {
+            rank[prefs[j]] = (IDX)j;
+        }
+    }
+}
+
+/* Seller s proposes to the next buyer on their list. Returns the seller left
+   unmatched by the proposal: s itself if the buyer prefers their current match,
+   the buyer's former match if s displaced them, or -1 if the buyer was free.
+   buyer_rank is only read in SOLVER_RANK mode; buyer_prefs only in SOLVER_SCAN. */
+static inline int FN(propose)(const struct instance *inst, enum solver_mode mode,
+                              struct match_state *st, int curr_seller) {
+    int n = st->n;
+    int curr_buyer = FN(row)(&inst->seller_prefs, curr_seller)[st->seller_next_choices[curr_seller]];  // Get buyer to propose to next
+    st->seller_next_choices[curr_seller]++;  // Update next buyer to propose to, if seller not matched this round
+    STAT_INC(st, proposals);
+    int other_seller = st->buyer_matches[curr_buyer];   // if no competing seller, is -1
+    // Get current seller's rank on this buyer's pref list
+    int curr_seller_rank = -1;
+    if (mode == SOLVER_RANK) {
+        curr_seller_rank = FN(row)(&inst->buyer_rank, curr_buyer)[curr_seller];
+    } else {
+        const IDX *prefs = FN(row)(&inst->buyer_prefs, curr_buyer);
+        for (int j = 0; j < n; j++) {
+            if ((int)prefs[j] == curr_seller) {
+                curr_seller_rank = j;
+                break;
+            }
+        }
+    }
+
+    /* No competing seller matched to this buyer already, so match this buyer
+       and seller, recording the buyer's ranking of the seller. */
+    if (other_seller == -1) {
+        st->buyer_final_prefs[curr_buyer] = curr_seller_rank;
+        st->buyer_matches[curr_buyer] = curr_seller;
+        st->seller_matches[curr_seller] = curr_buyer;
+        return -1;
+    }
+    /* There is a competing seller. If current seller is ranked higher than
+       competitor, assign as new match to this buyer, and make former matched
+       seller open again  */
+    if (curr_seller_rank < st->buyer_final_prefs[curr_buyer]) {
+        st->buyer_final_prefs[curr_buyer] = curr_seller_rank;
+        st->buyer_matches[curr_buyer] = curr_seller;
+        st->seller_matches[curr_seller] = curr_buyer;
+        st->seller_matches[other_seller] = -1;
+        STAT_INC(st, engagements_broken);
+        return other_seller;
+    }
+    STAT_INC(st, rejections);
+    return curr_seller;
+}
+
+/* Runs the stable marriage algorithm with sellers proposing, starting from the
+   state in st (everyone unmatched, every seller's next choice their favorite).
+   The schedule only decides which free seller proposes next; every order ends in
+   the same seller-optimal matching. */
+static void FN(solve)(const struct instance *inst, enum solver_mode mode,
+                      enum schedule schedule, struct match_state *st) {
+    int n = st->n;
+    int *free_sellers = st->free_sellers;
+
+    if (schedule == SCHEDULE_ROUND_ROBIN) {
+        /* Sweep over all sellers, letting each unmatched one propose, until
+           everyone is matched */
+        int bachelor_count = n; // Number of unmatched sellers. We terminate when we get this to 0
+        while (bachelor_count > 0) {
+            STAT_INC(st, rounds);
+            for (int curr_seller = 0; curr_seller < n; curr_seller++) {
+                if (st->seller_matches[curr_seller] == -1) {
+                    if (FN(propose)(inst, mode, st, curr_seller) == -1) {
+                        bachelor_count--;
+                    }
+                }
+            }
+        }
+    } else if (schedule == SCHEDULE_LIFO) {
+        /* Free sellers wait on a stack; whoever is left unmatched by a proposal is
+           pushed back, so a rejected seller keeps proposing until they stick */
+        int top = 0;
+        for (int i = n - 1; i >= 0; i--) {
+            free_sellers[top++] = i;
+        }
+        while (top > 0) {
+            int left_over = FN(propose)(inst, mode, st, free_sellers[--top]);
+            if (left_over != -1) {
+                free_sellers[top++] = left_over;
+            }
+        }
+    } else {
+        /* Free sellers wait in a ring buffer of n slots, enough because at most n
+           sellers are ever free at once; whoever is left unmatched rejoins the back */
+        int head = 0;
+        int count = n;
+        for (int i = 0; i < n; i++) {
+            free_sellers[i] = i;
+        }
+        while (count > 0) {
+            int curr_seller = free_sellers[head];
+            head = head + 1 == n ? 0 : head + 1;
+            count--;
+            int left_over = FN(propose)(inst, mode, st, curr_seller);
+            if (left_over != -1) {
+                int tail = head + count >= n ? head + count - n : head + count;
+                free_sellers[tail] = left_over;
+                count++;
+            }
+        }
+    }
+}
+
+/* The LIFO rank solve, starting from whatever state st is in with top sellers on
+   the free stack, so it can take up a solve a snapshot left off. Every
+   CHECKPOINT_STRIDE proposals it offers its state to ck, if there is one, which
+   costs a look at the clock unless a snapshot is due. */
+static void FN(solve_checkpointed)(const struct instance *inst, struct match_state *st, int top,
+                                   struct checkpointer *ck) {
+    int *free_sellers = st->free_sellers;
+    int until_poll = CHECKPOINT_STRIDE;
+    while (top > 0) {
+        int left_over = FN(propose)(inst, SOLVER_RANK, st, free_sellers[--top]);
+        if (left_over != -1) {
+            free_sellers[top++] = left_over;
+        }
+        if (--until_poll == 0) {
+            if (ck != NULL) {
+                checkpoint_poll(ck, st, top);
+            }
+            until_poll = CHECKPOINT_STRIDE;
+        }
+    }
+}
+
+/* The LIFO solve with proposals pipelined across PIPELINE_DEPTH free sellers at a
+   time, for instances too large for cache. Each round first finds every batched
+   seller's next buyer and prefetches the rank entry and holder it will compare,
+   then resolves the proposals in order while those loads are in flight; whoever a
+   proposal leaves free takes the proposer's slot, and empty slots are refilled
+   from the stack. Two sellers in a batch may propose to the same buyer, which is
+   why the holder is only read when resolving. The order of proposals differs from
+   SCHEDULE_LIFO's, but the seller-optimal matching is the same. Needs buyer_rank. */
+static void FN(solve_pipelined)(const struct instance *inst, struct match_state *st) {
+    int n = st->n;
+    int *free_sellers = st->free_sellers;
+    int batch[PIPELINE_DEPTH];
+    int targets[PIPELINE_DEPTH];
+    int active = 0;
+    int top = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        free_sellers[top++] = i;
+    }
+    while (top > 0 || active > 0) {
+        while (active < PIPELINE_DEPTH && top > 0) {
+            batch[active++] = free_sellers[--top];
+        }
+        for (int k = 0; k < active; k++) {
+            int s = batch[k];
+            int b = FN(row)(&inst->seller_prefs, s)[st->seller_next_choices[s]];
+            targets[k] = b;
+            __builtin_prefetch(&FN(row)(&inst->buyer_rank, b)[s]);
+            __builtin_prefetch(&st->buyer_matches[b]);
+            __builtin_prefetch(&st->buyer_final_prefs[b]);
+        }
+        int kept = 0;
+        for (int k = 0; k < active; k++) {
+            int s = batch[k];
+            int b = targets[k];
+            st->seller_next_choices[s]++;
+            STAT_INC(st, proposals);
+            int rank = FN(row)(&inst->buyer_rank, b)[s];
+            int other_seller = st->buyer_matches[b];
+            int left_over;
+            if (other_seller >= 0 && rank >= st->buyer_final_prefs[b]) {
+                STAT_INC(st, rejections);
+                left_over = s;
+            } else {
+                st->buyer_final_prefs[b] = rank;
+                st->buyer_matches[b] = s;
+                st->seller_matches[s] = b;
+                if (other_seller >= 0) {
+                    st->seller_matches[other_seller] = -1;
+                    STAT_INC(st, engagements_broken);
+                }
+                left_over = other_seller;
+            }
+            if (left_over >= 0) {
+                batch[kept++] = left_over;
+                __builtin_prefetch(&FN(row)(&inst->seller_prefs, left_over)[st->seller_next_choices[left_over]]);
+            }
+        }
+        active = kept;
+    }
+}
+
+/* Many-to-one version of the LIFO solve: a buyer with room keeps every proposer, and
+   a full one compares the proposer with the root of their heap, their weakest
+   holder, instead of with a single partner. A seller cannot run out of buyers as
+   long as every buyer can hold at least one seller. Needs buyer_rank. */
+static void FN(solve_capacitated)(const struct instance *inst, struct match_state *st,
+                                  struct buyer_heaps *heaps) {
+    int n = st->n;
+    int top = 0;
+    for (int b = 0; b < n; b++) {
+        heaps->sizes[b] = 0;
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        st->free_sellers[top++] = i;
+    }
+    while (top > 0) {
+        int curr_seller = st->free_sellers[--top];
+        while (curr_seller >= 0) {
+            int curr_buyer = FN(row)(&inst->seller_prefs, curr_seller)[st->seller_next_choices[curr_seller]++];
+            STAT_INC(st, proposals);
+            uint64_t key = (uint64_t)FN(row)(&inst->buyer_rank, curr_buyer)[curr_seller] << 32
+                           | (uint32_t)curr_seller;
+            int left_over = heap_offer(heaps, curr_buyer, key);
+            if (left_over == curr_seller) {
+                STAT_INC(st, rejections);
+            } else {
+                st->seller_matches[curr_seller] = curr_buyer;
+                if (left_over >= 0) {
+                    st->seller_matches[left_over] = -1;
+                    STAT_INC(st, engagements_broken);
+                }
+            }
+            curr_seller = left_over;
+        }
+    }
+    for (int b = 0; b < n; b++) {
+        st->buyer_matches[b] = st->buyer_final_prefs[b] = -1;
+        if (heaps->sizes[b] > 0) {
+            uint64_t root = heaps->entries[heaps->offsets[b]];
+            st->buyer_matches[b] = (int)(uint32_t)root;
+            st->buyer_final_prefs[b] = (int)(root >> 32);
+        }
+    }
+}
+
+/* Concurrent proposals, after McVitie and Wilson: sellers begin..end-1 each start a
+   chain of proposals that may run alongside other threads' chains. A buyer's
+   current holder is one packed (rank << 32 | seller) word, so a lower word is a
+   better seller, and a proposal compare-and-swaps its own word in if it is lower
+   than the one held. The seller who loses out, whether the proposer or the
+   displaced holder, carries the chain on at once, which keeps a thread busy with at
+   most one free seller and means every free seller is owned by exactly one thread,
+   so seller_next_choices needs no synchronization. The chain ends when a proposal
+   reaches a free buyer. Since the seller-optimal matching does not depend on the
+   order of proposals, this ends in the same matching as the serial solver. */
+static void FN(solve_concurrent)(const struct instance *inst, struct match_state *st,
+                                 _Atomic uint64_t *holders, int begin, int end) {
+    for (int s = begin; s < end; s++) {
+        int curr_seller = s;
+        while (curr_seller >= 0) {
+            int curr_buyer = FN(row)(&inst->seller_prefs, curr_seller)[st->seller_next_choices[curr_seller]++];
+            uint64_t mine = (uint64_t)FN(row)(&inst->buyer_rank, curr_buyer)[curr_seller] << 32
+                            | (uint32_t)curr_seller;
+            uint64_t held = atomic_load_explicit(&holders[curr_buyer], memory_order_acquire);
+            while (mine < held && !atomic_compare_exchange_weak_explicit(&holders[curr_buyer], &held, mine,
+                                                                         memory_order_acq_rel,
+                                                                         memory_order_acquire)) {
+            }
+            if (mine < held) {
+                // Engaged; whoever held the buyer before, if anyone, is free again
+                curr_seller = held == HOLDER_NONE ? -1 : (int)(uint32_t)held;
+            }
+        }
+    }
+}
+
+/* Incremental re-solving. A finished solve leaves every buyer ahead of a seller's
+   next choice holding someone they prefer to that seller, since each of them turned
+   the seller down, and that is what makes the final matching stable. When some
+   rows change, a re-solve only restores this where the change broke it, then lets
+   the sellers it freed resume proposing from where they stand. */
+
+/* Matches free buyer b to the seller they like best among those who have already
+   passed them over (b lies ahead of the seller's next choice). That seller ranks b
+   above their current partner, so they leave the partner for b, and the partner is
+   repaired the same way in turn; the chain ends at a buyer nobody has passed, who
+   stays free. Each step moves a seller to an earlier choice, so the chain is finite.
+   Needs seller_rank. Returns the number of sellers moved. */
+static uint64_t FN(repair_buyer)(const struct instance *inst, struct match_state *st, int b) {
+    uint64_t moves = 0;
+    while (b >= 0) {
+        const IDX *prefs = FN(row)(&inst->buyer_prefs, b);
+        int taken = -1;
+        int taken_rank = -1;
+        for (int j = 0; j < st->n; j++) {
+            int s = prefs[j];
+            if ((int)FN(row)(&inst->seller_rank, s)[b] < st->seller_next_choices[s]) {
+                taken = s;
+                taken_rank = j;
+                break;
+            }
+        }
+        st->buyer_final_prefs[b] = taken_rank;
+        st->buyer_matches[b] = taken;
+        if (taken < 0) {
+            return moves;
+        }
+        int freed = st->seller_matches[taken];
+        st->seller_matches[taken] = b;
+        st->seller_next_choices[taken] = FN(row)(&inst->seller_rank, taken)[b] + 1;
+        if (freed >= 0) {
+            st->buyer_matches[freed] = -1;
+            st->buyer_final_prefs[freed] = -1;
+        }
+        moves++;
+        b = freed;
+    }
+    return moves;
+}
+
+/* Re-solves st, a finished seller-proposing solve of inst, after the preference
+   lists of the given sellers and buyers have changed in place. The changed rows of
+   both rank tables are rebuilt first. A changed seller starts over from their new
+   favorite, and the buyer they leave is repaired; a changed buyer drops their
+   partner back among the free sellers and is repaired under their new list. The
+   free sellers then propose as usual, using free_sellers as the stack and queued
+   as an n-bit bitset, all zero on entry and on return, that keeps each seller on it
+   once. Costs time in proportion to the proposals and repairs the change causes,
+   plus a scan down each repaired buyer's list. Returns their number. */
+static uint64_t FN(resolve)(struct instance *inst, struct match_state *st,
+                            const int *sellers, int nsellers, const int *buyers, int nbuyers,
+                            uint64_t *queued) {
+    uint64_t work = 0;
+    int top = 0;
+    for (int k = 0; k < nsellers; k++) {
+        FN(build_rank_rows)(&inst->seller_prefs, &inst->seller_rank, sellers[k], sellers[k] + 1);
+    }
+    for (int k = 0; k < nbuyers; k++) {
+        FN(build_rank_rows)(&inst->buyer_prefs, &inst->buyer_rank, buyers[k], buyers[k] + 1);
+    }
+    for (int k = 0; k < nsellers + nbuyers; k++) {
+        int s, b;
+        if (k < nsellers) {
+            s = sellers[k];
+            b = st->seller_matches[s];
+            st->seller_next_choices[s] = 0;
+        } else {
+            b = buyers[k - nsellers];
+            s = st->buyer_matches[b];
+        }
+        if (s >= 0 && st->seller_matches[s] >= 0) {
+            st->buyer_matches[st->seller_matches[s]] = -1;
+            st->buyer_final_prefs[st->seller_matches[s]] = -1;
+            st->seller_matches[s] = -1;
+        }
+        if (s >= 0 && (queued[s / 64] >> (s % 64) & 1) == 0) {
+            queued[s / 64] |= (uint64_t)1 << (s % 64);
+            st->free_sellers[top++] = s;
+        }
+        if (b >= 0 && st->buyer_matches[b] < 0) {
+            work += FN(repair_buyer)(inst, st, b);
+        }
+    }
+    while (top > 0) {
+        int curr_seller = st->free_sellers[--top];
+        queued[curr_seller / 64] &= ~((uint64_t)1 << (curr_seller % 64));
+        // A repair may have matched them again since they were freed
+        while (curr_seller >= 0 && st->seller_matches[curr_seller] < 0) {
+            curr_seller = FN(propose)(inst, SOLVER_RANK, st, curr_seller);
+            work++;
+        }
+    }
+    return work;
+}
+
+/* Finds every rotation of inst by the walk of Gusfield and Irving from the
+   seller-optimal matching to the buyer-optimal one. matches (each seller's buyer)
+   and held (each buyer's seller) start at the seller-optimal matching and end at
+   the buyer-optimal one, whose sellers' half is last. A seller's next buyer is the
+   first after their partner on their list who prefers them to their own partner.
+   The walk follows sellers to the partner of their next buyer on a stack, and
+   when it comes back to a seller already on the stack, the cycle is a rotation,
+   which it records and eliminates. Buyers' partners only improve on the way, so a
+   buyer passed over stays passed over, and each seller's search goes on from
+   where it stopped: the whole walk is O(n^2). Each rotation is appended to out,
+   with an edge to it from the rotation that last moved each of its sellers, the
+   first kind of precedence. Needs both rank tables. */
+static void FN(find_rotations)(const struct instance *inst, const int *last, int *matches, int *held,
+                               struct rotation_lists *out) {
+    int n = inst->n;
+    int *pos = alloc_array(n, sizeof(int), "rotation walk");       // where each seller's search is
+    int *stack = alloc_array(n, sizeof(int), "rotation walk");
+    int *depth = alloc_array(n, sizeof(int), "rotation walk");     // place on the stack, or -1
+    int *moved_by = alloc_array(n, sizeof(int), "rotation walk");  // rotation that last moved each seller
+    for (int s = 0; s < n; s++) {
+        pos[s] = FN(row)(&inst->seller_rank, s)[matches[s]] + 1;
+        depth[s] = -1;
+        moved_by[s] = -1;
+    }
+    int top = 0;
+    int start = 0;
+    for (;;) {
+        if (top == 0) {
+            while (start < n && matches[start] == last[start]) {
+                start++;
+            }
+            if (start == n) {
+                break;
+            }
+            depth[start] = 0;
+            stack[top++] = start;
+        }
+        int s = stack[top - 1];
+        const IDX *prefs = FN(row)(&inst->seller_prefs, s);
+        int b = prefs[pos[s]];
+        while (FN(row)(&inst->buyer_rank, b)[s] > FN(row)(&inst->buyer_rank, b)[held[b]]) {
+            b = prefs[++pos[s]];
+        }
+        int t = held[b];
+        if (depth[t] < 0) {
+            depth[t] = top;
+            stack[top++] = t;
+            continue;
+        }
+        /* The stack from t up is a rotation. Each seller on it moves to the buyer of
+           the one above, and the top seller to t's buyer, b. */
+        int r = (int)out->ends.count - 1;
+        int first = depth[t];
+        for (int i = first; i < top; i++) {
+            int u = stack[i];
+            int_list_push(&out->sellers, u);
+            int_list_push(&out->buyers, matches[u]);
+            if (moved_by[u] >= 0) {
+                int_list_push(&out->edges, moved_by[u]);
+                int_list_push(&out->edges, r);
+            }
+            moved_by[u] = r;
+            depth[u] = -1;
+        }
+        size_list_push(&out->ends, out->sellers.count);
+        for (int i = first; i < top; i++) {
+            int u = stack[i];
+            int next_buyer = i + 1 < top ? matches[stack[i + 1]] : b;
+            matches[u] = next_buyer;
+            held[next_buyer] = u;
+            pos[u]++;
+        }
+        top = first;
+    }
+    free(pos);
+    free(stack);
+    free(depth);
+    free(moved_by);
+}
+
+/* Sums of the sellers' and the buyers' ranks of their partners in a matching */
+static void FN(matching_costs)(const struct instance *inst, const int *matches, int64_t *seller_cost,
+                               int64_t *buyer_cost) {
+    *seller_cost = *buyer_cost = 0;
+    for (int s = 0; s < inst->n; s++) {
+        *seller_cost += FN(row)(&inst->seller_rank, s)[matches[s]];
+        *buyer_cost += FN(row)(&inst->buyer_rank, matches[s])[s];
+    }
+}
+
+/* Adds the second kind of precedence edge to out and works out each rotation's
+   change in cost. When a rotation moves a seller past buyers on their list, each
+   of those buyers must already have a partner they prefer to the seller, and the
+   rotation that first gave them one has to come first. It is found by bisection
+   in the buyer's partners over the walk, whose ranks only fall. */
+static void FN(rotation_precedence)(const struct instance *inst, struct rotation_poset *p,
+                                    const int *seller_optimal, struct rotation_lists *out) {
+    int n = inst->n;
+    size_t pairs = p->offsets[p->count];
+
+    /* Buyer b's partners, in order, are history_ranks[history_offsets[b]] onwards,
+       with the rotations that brought them (-1 for the seller-optimal partner) */
+    size_t *history_offsets = alloc_array((size_t)n + 1, sizeof(size_t), "partner history");
+    int *history_ranks = alloc_array((size_t)n + pairs, sizeof(int), "partner history");
+    int *history_rotations = alloc_array((size_t)n + pairs, sizeof(int), "partner history");
+    for (int b = 0; b <= n; b++) {
+        history_offsets[b] = 0;
+    }
+    for (size_t i = 0; i < pairs; i++) {
+        history_offsets[p->buyers[i]]++;
+    }
+    size_t total = 0;
+    for (int b = 0; b < n; b++) {
+        size_t count = history_offsets[b] + 1;
+        history_offsets[b] = total;
+        total += count;
+    }
+    history_offsets[n] = total;
+    for (int s = 0; s < n; s++) {
+        int b = seller_optimal[s];
+        history_ranks[history_offsets[b]] = FN(row)(&inst->buyer_rank, b)[s];
+        history_rotations[history_offsets[b]++] = -1;
+    }
+    for (int r = 0; r < p->count; r++) {
+        size_t begin = p->offsets[r];
+        size_t end = p->offsets[r + 1];
+        for (size_t i = begin; i < end; i++) {
+            int b = p->buyers[i + 1 < end ? i + 1 : begin];
+            history_ranks[history_offsets[b]] = FN(row)(&inst->buyer_rank, b)[p->sellers[i]];
+            history_rotations[history_offsets[b]++] = r;
+        }
+    }
+    for (int b = n; b > 0; b--) {
+        history_offsets[b] = history_offsets[b - 1];
+    }
+    history_offsets[0] = 0;
+
+    for (int r = 0; r < p->count; r++) {
+        size_t begin = p->offsets[r];
+        size_t end = p->offsets[r + 1];
+        int64_t seller_delta = 0;
+        int64_t buyer_delta = 0;
+        for (size_t i = begin; i < end; i++) {
+            int s = p->sellers[i];
+            int from = p->buyers[i];
+            int to = p->buyers[i + 1 < end ? i + 1 : begin];
+            int dropped = p->sellers[i + 1 < end ? i + 1 : begin];  // to's partner before r
+            const IDX *seller_rank = FN(row)(&inst->seller_rank, s);
+            const IDX *to_rank = FN(row)(&inst->buyer_rank, to);
+            seller_delta += (int64_t)seller_rank[to] - seller_rank[from];
+            buyer_delta += (int64_t)to_rank[s] - to_rank[dropped];
+            const IDX *prefs = FN(row)(&inst->seller_prefs, s);
+            for (int j = seller_rank[from] + 1; j < (int)seller_rank[to]; j++) {
+                int b = prefs[j];
+                int rank = FN(row)(&inst->buyer_rank, b)[s];
+                size_t lo = history_offsets[b];
+                size_t hi = history_offsets[b + 1];
+                while (lo < hi) {
+                    size_t mid = lo + (hi - lo) / 2;
+                    if (history_ranks[mid] < rank) {
+                        hi = mid;
+                    } else {
+                        lo = mid + 1;
+                    }
+                }
+                if (lo < history_offsets[b + 1] && history_rotations[lo] >= 0) {
+                    int_list_push(&out->edges, history_rotations[lo]);
+                    int_list_push(&out->edges, r);
+                }
+            }
+        }
+        p->seller_delta[r] = seller_delta;
+        p->buyer_delta[r] = buyer_delta;
+    }
+    free(history_offsets);
+    free(history_ranks);
+    free(history_rotations);
+}
+
+/* Fills rows begin..end-1 of a node's block, counted from its first seller and
+   buyer, from the same streams as generate_rows, so the nodes between them hold
+   exactly the instance a single solve of the seed would. Each buyer's list is
+   shuffled into scratch and only its inverse kept. */
+static void FN(node_generate_rows)(struct node_instance *inst, uint64_t seed, int begin, int end) {
+    int n = inst->n;
+    IDX *list = alloc_array(n, sizeof(IDX), "buyer list scratch");
+    struct rng rng;
+    for (int i = begin; i < end; i++) {
+        rng_seed(&rng, seed, SELLER_STREAM(inst->begin + i));
+        FN(shuffle_array)(&rng, FN(row)(&inst->seller_prefs, i), n);
+        rng_seed(&rng, seed, BUYER_STREAM(inst->begin + i));
+        FN(shuffle_array)(&rng, list, n);
+        IDX *rank = FN(row)(&inst->buyer_rank, i);
+        for (int j = 0; j < n; j++) {
+            rank[list[j]] = (IDX)j;
+        }
+    }
+    free(list);
+}
+
+/* Inverts the lists of the node's buyers begin..end-1, counted from its first, out
+   of the whole instance's buyer_prefs */
+static void FN(node_rank_rows)(struct node_instance *inst, const struct pref_matrix *buyer_prefs, int begin,
+                               int end) {
+    int n = inst->n;
+    for (int i = begin; i < end; i++) {
+        const IDX *prefs = FN(row)(buyer_prefs, inst->begin + i);
+        IDX *rank = FN(row)(&inst->buyer_rank, i);
+        for (int j = 0; j < n; j++) {
+            rank[prefs[j]] = (IDX)j;
+        }
+    }
+}
+
+/* Seller s, of any node, proposes to the node's buyer begin + j. Returns the seller
+   left unmatched, as propose does. */
+static inline int FN(node_offer)(const struct node_instance *inst, struct match_state *st, int j, int s) {
+    int rank = FN(row)(&inst->buyer_rank, j)[s];
+    int other = st->buyer_matches[j];
+    if (other != -1 && rank > st->buyer_final_prefs[j]) {
+        STAT_INC(st, rejections);
+        return s;
+    }
+    st->buyer_final_prefs[j] = rank;
+    st->buyer_matches[j] = s;
+    if (other != -1) {
+        STAT_INC(st, engagements_broken);
+    }
+    return other;
+}
+
+/* The propose half of a round: every free seller of the node proposes to their next
+   choice, taking them off the stack of top free sellers. A proposal to a buyer of
+   the same node is settled on the spot, and whoever it leaves free goes back on the
+   stack or, for another node's seller, into replies; one to another node's buyer is
+   queued in proposals as (buyer, seller) for the exchange. */
+static void FN(node_propose)(const struct node_instance *inst, struct match_state *st, int *top,
+                             struct int_list *proposals, struct int_list *replies) {
+    while (*top > 0) {
+        int i = st->free_sellers[--*top];
+        int b = FN(row)(&inst->seller_prefs, i)[st->seller_next_choices[i]++];
+        STAT_INC(st, proposals);
+        st->seller_matches[i] = b;  // for good, unless the seller comes back free
+        if (b < inst->begin || b >= inst->end) {
+            int_list_push(proposals, b);
+            int_list_push(proposals, inst->begin + i);
+        } else {
+            node_release(inst, st, top, replies, FN(node_offer)(inst, st, b - inst->begin, inst->begin + i));
+        }
+    }
+}
+
+/* The reply half: the node's buyers consider the count (buyer, seller) proposals
+   other nodes sent them, and whoever each leaves free goes back on the stack or
+   into replies */
+static void FN(node_answer)(const struct node_instance *inst, struct match_state *st, const uint32_t *msgs,
+                            size_t count, int *top, struct int_list *replies) {
+    for (size_t k = 0; k < count; k++) {
+        int b = (int)msgs[2 * k], s = (int)msgs[2 * k + 1];
+        node_release(inst, st, top, replies, FN(node_offer)(inst, st, b - inst->begin, s));
+    }
+}
+
+/* Queues the queries that check the node's sellers from *cursor on, until about
+   limit words are queued or none are left. Seller s asks their partner whether
+   they hold s, as (buyer, s | NODE_HOLDS), and every buyer they rank above their
+   partner whether that buyer would rather have s, as (buyer, s). */
+static void FN(node_verify_queries)(const struct node_instance *inst, const struct match_state *st, int *cursor,
+                                    size_t limit, struct int_list *queries, struct verify_result *v) {
+    int count = inst->end - inst->begin;
+    for (; *cursor < count && queries->count < limit; ++*cursor) {
+        int i = *cursor, s = inst->begin + i;
+        int partner = st->seller_matches[i];
+        if (partner < 0 || partner >= inst->n) {
+            verify_fail(v, VERIFY_NOT_PERFECT, s, partner);
+            continue;
+        }
+        int_list_push(queries, partner);
+        int_list_push(queries, (int)((uint32_t)s | NODE_HOLDS));
+        const IDX *prefs = FN(row)(&inst->seller_prefs, i);
+        for (int j = 0; j < inst->n && (int)prefs[j] != partner; j++) {
+            int_list_push(queries, prefs[j]);
+            int_list_push(queries, s);
+        }
+    }
+}
+
+/* Answers count queries sent to the node's buyers, failing v on the first wrong
+   answer */
+static void FN(node_verify_answer)(const struct node_instance *inst, const struct match_state *st,
+                                   const uint32_t *msgs, size_t count, struct verify_result *v) {
+    for (size_t k = 0; k < count; k++) {
+        int j = (int)msgs[2 * k] - inst->begin;
+        int s = (int)(msgs[2 * k + 1] & ~NODE_HOLDS);
+        int held = st->buyer_matches[j];
+        if (msgs[2 * k + 1] & NODE_HOLDS) {
+            if (held != s) {
+                verify_fail(v, VERIFY_NOT_PERFECT, s, inst->begin + j);
+            }
+        } else if (held < 0 || FN(row)(&inst->buyer_rank, j)[s] < FN(row)(&inst->buyer_rank, j)[held]) {
+            verify_fail(v, VERIFY_BLOCKING_PAIR, s, inst->begin + j);
+        }
+    }
+}
+
+/* Checks sellers begin..end-1 of a finished many-to-one matching. Each seller's
+   buyer must hold them, and every buyer the seller ranks above that one must be
+   full of holders they all prefer to the seller. */
+static void FN(verify_capacitated_sellers)(const struct instance *inst, const struct match_state *st,
+                                           const struct buyer_heaps *heaps, int begin, int end,
+                                           struct verify_result *v) {
+    int n = inst->n;
+    for (int s = begin; s < end; s++) {
+        if (atomic_load_explicit(&v->failed, memory_order_relaxed)) {
+            return;
+        }
+        int partner = st->seller_matches[s];
+        if (partner < 0 || partner >= n || !heap_holds(heaps, partner, s)) {
+            verify_fail(v, VERIFY_NOT_PERFECT, s, partner);
+            return;
+        }
+        const IDX *prefs = FN(row)(&inst->seller_prefs, s);
+        for (int j = 0; (int)prefs[j] != partner; j++) {
+            int b = prefs[j];
+            uint64_t key = (uint64_t)FN(row)(&inst->buyer_rank, b)[s] << 32 | (uint32_t)s;
+            if (heaps->sizes[b] < heaps->capacities[b] || key < heaps->entries[heaps->offsets[b]]) {
+                verify_fail(v, VERIFY_BLOCKING_PAIR, s, b);
+                return;
+            }
+        }
+    }
+}
+
+/* Checks sellers begin..end-1 of a finished matching. Each seller must hold a buyer
+   who holds them back, which over all sellers makes the matching perfect, and no
+   buyer the seller ranks above their partner may prefer the seller to the buyer's
+   own partner. Only the buyers ahead of the partner on each seller's list are
+   visited, so the whole check costs no more than the proposals that produced the
+   matching. Records the first violation it sees in v. */
+static void FN(verify_sellers)(const struct instance *inst, const struct match_state *st,
+                               int begin, int end, struct verify_result *v) {
+    int n = inst->n;
+    for (int s = begin; s < end; s++) {
+        if (atomic_load_explicit(&v->failed, memory_order_relaxed)) {
+            return;
+        }
+        int partner = st->seller_matches[s];
+        if (partner < 0 || partner >= n || st->buyer_matches[partner] != s) {
+            verify_fail(v, VERIFY_NOT_PERFECT, s, partner);
+            return;
+        }
+        const IDX *prefs = FN(row)(&inst->seller_prefs, s);
+        for (int j = 0; (int)prefs[j] != partner; j++) {
+            int b = prefs[j];
+            const IDX *rank = FN(row)(&inst->buyer_rank, b);
+            int held = st->buyer_matches[b];
+            // A buyer holding nobody would take s, so that is a blocking pair too
+            if (held < 0 || held >= n || rank[s] < rank[held]) {
+                verify_fail(v, VERIFY_BLOCKING_PAIR, s, b);
+                return;
+            }
+        }
+    }
+}
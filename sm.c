@@ -0,0 +1,3091 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sm.h"
+
+#ifdef SM_MPI
+#include <limits.h>
+#include <mpi.h>
+#endif
+
+/* Vector kernels, built with per-function target attributes so that the rest of the
+   file needs no special flags, and picked at run time by CPU feature */
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SM_X86_KERNELS
+#endif
+
+/* Packed holder word of a buyer nobody has proposed to, in the parallel solver */
+#define HOLDER_NONE UINT64_MAX
+
+/* Heap allocations are aligned to a cache line, so rows and arrays never share a
+   line with unrelated data */
+#define ALLOC_ALIGNMENT 64
+
+/* Allocations of at least a huge page are aligned to one and offered to the kernel
+   as transparent huge pages, so the solver's random accesses into the matrices miss
+   the TLB far less often */
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/* Free sellers the pipelined solver keeps proposals in flight for */
+#define PIPELINE_DEPTH 16
+
+/* Proposals between a checkpointed solve's looks at the clock */
+#define CHECKPOINT_STRIDE 65536
+
+#ifdef SM_STATS
+#define STAT_INC(st, counter) ((st)->counters.counter++)
+#else
+#define STAT_INC(st, counter) ((void)0)
+#endif
+
+/* xoshiro256** pseudo-random generator (Blackman & Vigna). Every preference row is
+   shuffled from its own stream, seeded from the run's seed and the row's stream id,
+   so rows can be generated independently and in any order but the instance for a
+   given seed is always the same. */
+struct rng {
+    uint64_t s[4];
+};
+
+static inline uint64_t rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/* splitmix64 step, used to expand a seed into a full generator state */
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/* Seeds r with substream number stream of the given seed */
+void rng_seed(struct rng *r, uint64_t seed, uint64_t stream) {
+    uint64_t x = stream;
+    x = seed ^ splitmix64(&x);
+    for (int i = 0; i < 4; i++) {
+        r->s[i] = splitmix64(&x);
+    }
+}
+
+static inline uint64_t rng_next(struct rng *r) {
+    uint64_t *s = r->s;
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return result;
+}
+
+/* Uniform integer in [0, bound), without modulo bias (Lemire's multiply-and-reject) */
+static inline uint32_t rng_below(struct rng *r, uint32_t bound) {
+    uint64_t m = (rng_next(r) >> 32) * bound;
+    uint32_t low = (uint32_t)m;
+    if (low < bound) {
+        uint32_t threshold = -bound % bound;
+        while (low < threshold) {
+            m = (rng_next(r) >> 32) * bound;
+            low = (uint32_t)m;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
+
+/* Stream ids of row i's generators: sellers take the even ones, buyers the odd */
+#define SELLER_STREAM(i) (2 * (uint64_t)(i))
+#define BUYER_STREAM(i) (2 * (uint64_t)(i) + 1)
+/* and --perturb the first one past every row's, for an instance of n a side */
+#define PERTURB_STREAM(n) (2 * (uint64_t)(n))
+/* Streams of the state a generator's rows share, such as master lists: side 0 is
+   the sellers' and side 1 the buyers' */
+#define MASTER_STREAM(n, side) (2 * (uint64_t)(n) + 1 + (side))
+
+/* Outcome of checking a matching. The first thread to find a problem records it. */
+enum verify_failure {
+    VERIFY_OK,
+    VERIFY_NOT_PERFECT,    // seller is unmatched, or their buyer is matched to someone else
+    VERIFY_BLOCKING_PAIR,  // seller and buyer prefer each other to their partners
+    VERIFY_NOT_HELD_BACK   // buyer holds a seller who is matched to someone else
+};
+
+struct verify_result {
+    atomic_bool failed;
+    enum verify_failure failure;
+    int seller;
+    int buyer;
+};
+
+static void verify_fail(struct verify_result *v, enum verify_failure failure, int seller, int buyer) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&v->failed, &expected, true)) {
+        v->failure = failure;
+        v->seller = seller;
+        v->buyer = buyer;
+    }
+}
+
+/* Memory accounting. The long-lived structures charge their bytes to a category
+   when allocated and release them when freed, so a run can report what its
+   memory went to and check a budget against it. Scratch buffers that live only
+   for part of one call are not charged; nor are mapped instance files, whose pages
+   belong to the page cache. */
+static _Atomic uint64_t mem_current[MEM_CATEGORIES];
+static _Atomic uint64_t mem_peak[MEM_CATEGORIES];
+static _Atomic uint64_t mem_current_total;
+static _Atomic uint64_t mem_peak_total;
+
+static void atomic_max(_Atomic uint64_t *a, uint64_t value) {
+    uint64_t seen = atomic_load_explicit(a, memory_order_relaxed);
+    while (seen < value && !atomic_compare_exchange_weak_explicit(a, &seen, value, memory_order_relaxed,
+                                                                  memory_order_relaxed)) {
+    }
+}
+
+static void mem_charge(enum mem_category c, uint64_t bytes) {
+    atomic_max(&mem_peak[c], atomic_fetch_add_explicit(&mem_current[c], bytes, memory_order_relaxed) + bytes);
+    atomic_max(&mem_peak_total,
+               atomic_fetch_add_explicit(&mem_current_total, bytes, memory_order_relaxed) + bytes);
+}
+
+static void mem_release(enum mem_category c, uint64_t bytes) {
+    atomic_fetch_sub_explicit(&mem_current[c], bytes, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&mem_current_total, bytes, memory_order_relaxed);
+}
+
+/* Current and peak charged bytes, per category and over all of them */
+void mem_usage_get(struct mem_usage *u) {
+    for (int c = 0; c < MEM_CATEGORIES; c++) {
+        u->current[c] = atomic_load(&mem_current[c]);
+        u->peak[c] = atomic_load(&mem_peak[c]);
+    }
+    u->current_total = atomic_load(&mem_current_total);
+    u->peak_total = atomic_load(&mem_peak_total);
+}
+
+/* Footprints: the bytes each representation charges, so that a caller can tell
+   whether an instance fits before allocating it */
+static uint64_t match_state_bytes(uint64_t nsellers, uint64_t nbuyers) {
+    return (3 * nsellers + 2 * nbuyers) * sizeof(int);
+}
+
+/* A stored n x n instance with the given number of rank tables and match states */
+uint64_t dense_footprint(int n, int width, int rank_tables, int match_states) {
+    return (2 + (uint64_t)rank_tables) * n * n * width + match_states * match_state_bytes(n, n);
+}
+
+/* A sparse instance in which each seller ranks length buyers, with its match state */
+uint64_t sparse_footprint(int nsellers, int nbuyers, int length) {
+    uint64_t total = (uint64_t)nsellers * length;
+    return ((uint64_t)nsellers + nbuyers + 2) * sizeof(size_t) + 4 * total * sizeof(uint32_t)
+           + match_state_bytes(nsellers, nbuyers);
+}
+
+/* A lazy instance, which stores nothing but its match state */
+uint64_t lazy_footprint(int n) {
+    return match_state_bytes(n, n);
+}
+
+/* Heaps for n buyers who can hold total_capacity sellers between them */
+uint64_t buyer_heaps_footprint(int n, uint64_t total_capacity) {
+    return ((uint64_t)n + 1) * sizeof(size_t) + (uint64_t)n * sizeof(int) + total_capacity * sizeof(uint64_t);
+}
+
+/* One node's block of a distributed instance split over the given number of nodes,
+   with its match state; the message buffers come on top */
+uint64_t node_footprint(int n, int width, int nodes) {
+    uint64_t rows = ((uint64_t)n + nodes - 1) / nodes;
+    return 2 * rows * n * width + match_state_bytes(rows, rows);
+}
+
+/* Narrowest matrix entry width, in bytes, that can hold every id and rank in 0..n-1 */
+int index_width_for(int n) {
+    return n - 1 <= UINT16_MAX ? 2 : 4;
+}
+
+/* Allocates an array of count elements of the given size, aligned to a cache line.
+   On overflow or when memory runs out, prints what was being allocated and exits
+   rather than letting a later write crash. */
+void *alloc_array(size_t count, size_t size, const char *what) {
+    void *p = NULL;
+    if (size != 0 && count > SIZE_MAX / size) {
+        fprintf(stderr, "Cannot allocate %s: %zu x %zu bytes overflows\n", what, count, size);
+        exit(1);
+    }
+    if (posix_memalign(&p, ALLOC_ALIGNMENT, count * size) != 0) {
+        fprintf(stderr, "Out of memory allocating %s (%zu bytes)\n", what, count * size);
+        exit(1);
+    }
+    return p;
+}
+
+/* Asks for p's bytes to be backed by transparent huge pages where that is supported */
+static void advise_huge_pages(void *p, size_t bytes) {
+#ifdef MADV_HUGEPAGE
+    if (bytes >= HUGE_PAGE_SIZE) {
+        madvise(p, bytes, MADV_HUGEPAGE);
+    }
+#else
+    (void)p;
+    (void)bytes;
+#endif
+}
+
+/* posix_memalign, aligned to a huge page and advised to use them when that large */
+static int alloc_huge(void **p, size_t bytes) {
+    int err = posix_memalign(p, bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : ALLOC_ALIGNMENT, bytes);
+    if (err == 0) {
+        advise_huge_pages(*p, bytes);
+    }
+    return err;
+}
+
+/* Allocates the first rows rows of m as an n x n matrix, charging them to category c */
+static void pm_alloc_rows(struct pref_matrix *m, int rows, int n, int width, enum mem_category c,
+                          const char *what) {
+    m->n = n;
+    m->width = width;
+    size_t count = (size_t)rows * n;
+    if (count > SIZE_MAX / width || alloc_huge(&m->data, count * width) != 0) {
+        fprintf(stderr, "Out of memory allocating %s (%zu x %d bytes)\n", what, count, width);
+        exit(1);
+    }
+    mem_charge(c, count * width);
+}
+
+/* Allocates m as an n x n matrix, charging it to category c */
+void pm_alloc(struct pref_matrix *m, int n, int width, enum mem_category c, const char *what) {
+    pm_alloc_rows(m, n, n, width, c, what);
+}
+
+/* Frees m, if it was allocated, releasing it from category c */
+void pm_free(struct pref_matrix *m, enum mem_category c) {
+    if (m->data != NULL) {
+        mem_release(c, (uint64_t)m->n * m->n * m->width);
+    }
+    free(m->data);
+    m->data = NULL;
+}
+
+/* Bytes that arena_alloc(a, count, size) will consume, including alignment */
+static size_t arena_bytes(size_t count, size_t size) {
+    return (count * size + ALLOC_ALIGNMENT - 1) / ALLOC_ALIGNMENT * ALLOC_ALIGNMENT;
+}
+
+/* Unlike alloc_array, returns false rather than exiting when memory runs out */
+static bool arena_init(struct arena *a, size_t size) {
+    void *p = NULL;
+    if (alloc_huge(&p, size) != 0) {
+        return false;
+    }
+    a->base = p;
+    a->size = size;
+    a->used = 0;
+    return true;
+}
+
+/* Cache-line aligned space for count elements; the arena must have been sized for it */
+static void *arena_alloc(struct arena *a, size_t count, size_t size) {
+    size_t bytes = arena_bytes(count, size);
+    if (bytes > a->size - a->used) {
+        fprintf(stderr, "Arena of %zu bytes is too small\n", a->size);
+        exit(1);
+    }
+    void *p = a->base + a->used;
+    a->used += bytes;
+    return p;
+}
+
+static void arena_free(struct arena *a) {
+    free(a->base);
+    a->base = NULL;
+}
+
+/* Offers seller key (rank << 32 | seller) to buyer b. Returns -1 if b had room and
+   kept them, the weakest holder's seller if the key displaced them, or the key's
+   own seller if b is full of holders they all prefer. O(log capacity). */
+static inline int heap_offer(struct buyer_heaps *heaps, int b, uint64_t key) {
+    uint64_t *heap = heaps->entries + heaps->offsets[b];
+    int size = heaps->sizes[b];
+    if (size < heaps->capacities[b]) {
+        int i = size;
+        while (i > 0 && heap[(i - 1) / 2] < key) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = key;
+        heaps->sizes[b] = size + 1;
+        return -1;
+    }
+    if (key > heap[0]) {
+        return (int)(uint32_t)key;
+    }
+    int displaced = (int)(uint32_t)heap[0];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size && heap[child + 1] > heap[child]) {
+            child++;
+        }
+        if (heap[child] < key) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = key;
+    return displaced;
+}
+
+/* True if seller s is among buyer b's holders */
+static bool heap_holds(const struct buyer_heaps *heaps, int b, int s) {
+    const uint64_t *heap = heaps->entries + heaps->offsets[b];
+    for (int i = 0; i < heaps->sizes[b]; i++) {
+        if ((int)(uint32_t)heap[i] == s) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Sorts n 64-bit keys by their high 32 bits, stably, using tmp as scratch for n
+   more. An LSD radix sort in three passes of 11, 11 and 10 bits, so a row of a
+   generated instance costs O(n) however it is keyed. The result ends up in keys. */
+static void sort_keys(uint64_t *keys, uint64_t *tmp, int n) {
+    static const int shifts[3] = { 32, 43, 54 };
+    uint64_t *from = keys, *to = tmp;
+    for (int pass = 0; pass < 3; pass++) {
+        int counts[2048] = {0};
+        int shift = shifts[pass];
+        for (int j = 0; j < n; j++) {
+            counts[from[j] >> shift & 2047]++;
+        }
+        int total = 0;
+        for (int d = 0; d < 2048; d++) {
+            int count = counts[d];
+            counts[d] = total;
+            total += count;
+        }
+        for (int j = 0; j < n; j++) {
+            to[counts[from[j] >> shift & 2047]++] = from[j];
+        }
+        uint64_t *t = from;
+        from = to;
+        to = t;
+    }
+    memcpy(keys, from, (size_t)n * sizeof(uint64_t));
+}
+
+static void checkpoint_poll(struct checkpointer *ck, const struct match_state *st, int top);
+
+/* Arrays that grow as entries are appended, for results whose size is not known
+   up front, such as an instance's rotations */
+struct int_list {
+    int *items;
+    size_t count;
+    size_t capacity;
+};
+
+struct size_list {
+    size_t *items;
+    size_t count;
+    size_t capacity;
+};
+
+static void *grow_list(void *items, size_t *capacity, size_t size) {
+    *capacity = *capacity > 0 ? 2 * *capacity : 1024;
+    void *p = realloc(items, *capacity * size);
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory growing a list to %zu entries\n", *capacity);
+        exit(1);
+    }
+    return p;
+}
+
+static inline void int_list_push(struct int_list *l, int v) {
+    if (l->count == l->capacity) {
+        l->items = grow_list(l->items, &l->capacity, sizeof(int));
+    }
+    l->items[l->count++] = v;
+}
+
+static inline void size_list_push(struct size_list *l, size_t v) {
+    if (l->count == l->capacity) {
+        l->items = grow_list(l->items, &l->capacity, sizeof(size_t));
+    }
+    l->items[l->count++] = v;
+}
+
+/* What the rotation walk builds: every rotation's pairs, where each ends, and the
+   precedence edges found so far as (before, after) pairs */
+struct rotation_lists {
+    struct int_list sellers;
+    struct int_list buyers;
+    struct size_list ends;
+    struct int_list edges;
+};
+
+/* Marks a verification query that asks a buyer whether they hold the seller, in
+   the high bit of the seller's id, which ids below 2^31 leave free */
+#define NODE_HOLDS 0x80000000u
+
+/* Puts a seller a node's buyer has just left free back in line: on the node's
+   stack of free sellers if the seller is the node's own, otherwise in the replies to
+   their node. -1, for nobody, is ignored. */
+static inline void node_release(const struct node_instance *inst, struct match_state *st, int *top,
+                                struct int_list *replies, int s) {
+    if (s >= inst->begin && s < inst->end) {
+        st->free_sellers[(*top)++] = s - inst->begin;
+    } else if (s >= 0) {
+        int_list_push(replies, s);
+    }
+}
+
+/* Instantiate the solver core once per matrix entry width */
+#define IDX uint16_t
+#define FN(name) name##_u16
+#include "sm-core.h"
+#undef IDX
+#undef FN
+
+#define IDX uint32_t
+#define FN(name) name##_u32
+#include "sm-core.h"
+#undef IDX
+#undef FN
+
+/* Calls the instantiation of a core function that matches the given entry width */
+#define DISPATCH(width, name, ...) \
+    ((width) == 2 ? name##_u16(__VA_ARGS__) : name##_u32(__VA_ARGS__))
+
+/* Allocates heap storage for an n x n instance with the given entry width */
+void instance_alloc(struct instance *inst, int n, int width) {
+    memset(inst, 0, sizeof(*inst));
+    inst->n = n;
+    inst->width = width;
+    pm_alloc(&inst->seller_prefs, n, width, MEM_PREFS, "seller preference lists");
+    pm_alloc(&inst->buyer_prefs, n, width, MEM_PREFS, "buyer preference lists");
+}
+
+void instance_free(struct instance *inst) {
+    if (inst->mapping != NULL) {
+        munmap(inst->mapping, inst->mapping_size);
+        inst->mapping = NULL;
+    } else {
+        pm_free(&inst->seller_prefs, MEM_PREFS);
+        pm_free(&inst->buyer_prefs, MEM_PREFS);
+    }
+    pm_free(&inst->buyer_rank, MEM_RANK);
+    pm_free(&inst->seller_rank, MEM_RANK);
+}
+
+/* Fills view with inst seen from the other side: buyers' lists in the seller role,
+   sellers' lists in the buyer role and the seller rank table as the buyer rank
+   table, so solving view has buyers propose. The view shares inst's storage, is
+   read-only, and is never freed itself. */
+void instance_mirror(const struct instance *inst, struct instance *view) {
+    memset(view, 0, sizeof(*view));
+    view->n = inst->n;
+    view->width = inst->width;
+    view->seller_prefs = inst->buyer_prefs;
+    view->buyer_prefs = inst->seller_prefs;
+    view->buyer_rank = inst->seller_rank;
+    view->seller_rank = inst->buyer_rank;
+}
+
+/* Binary instance files. A file is a header page followed by the seller matrix and
+   then the buyer matrix, each stored row-major exactly as in memory (host byte
+   order, entries index_width bytes wide) and starting on a page boundary, so a
+   loaded file is used in place through a read-only mapping. The checksum covers
+   both matrices. */
+#define INSTANCE_MAGIC "SMINST\r\n"
+#define INSTANCE_VERSION 1
+#define INSTANCE_ALIGN 4096
+
+struct instance_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t index_width;     // bytes per entry: 2 or 4
+    uint64_t n;
+    uint64_t checksum;
+    uint64_t seller_offset;   // byte offsets of the two matrices from the start of the file
+    uint64_t buyer_offset;
+    uint64_t reserved[3];
+};
+
+static uint64_t round_up(uint64_t x, uint64_t align) {
+    return (x + align - 1) / align * align;
+}
+
+/* 64-bit checksum over a buffer whose size is a multiple of 8 bytes, mixing four
+   words at a time in independent lanes so it runs at close to memory speed */
+static uint64_t checksum_words(const void *data, size_t size, uint64_t h) {
+    const uint64_t *w = data;
+    size_t words = size / 8;
+    uint64_t lane[4] = { h, h ^ 1, h ^ 2, h ^ 3 };
+    size_t i = 0;
+    for (; i + 4 <= words; i += 4) {
+        for (int k = 0; k < 4; k++) {
+            lane[k] = rotl64(lane[k] ^ w[i + k], 29) * 0x9E3779B97F4A7C15ull;
+        }
+    }
+    for (; i < words; i++) {
+        lane[0] = rotl64(lane[0] ^ w[i], 29) * 0x9E3779B97F4A7C15ull;
+    }
+    uint64_t x = lane[0] ^ rotl64(lane[1], 16) ^ rotl64(lane[2], 32) ^ rotl64(lane[3], 48);
+    return splitmix64(&x);
+}
+
+/* Checksum of an instance's two matrices. Matrix sizes need not be multiples of 8,
+   so the tail of each is folded in separately. */
+static uint64_t instance_checksum(const struct instance *inst) {
+    size_t bytes = (size_t)inst->n * inst->n * inst->width;
+    size_t body = bytes & ~(size_t)7;
+    uint64_t h = inst->n;
+    const struct pref_matrix *matrices[2] = { &inst->seller_prefs, &inst->buyer_prefs };
+    for (int m = 0; m < 2; m++) {
+        const unsigned char *data = matrices[m]->data;
+        h = checksum_words(data, body, h);
+        uint64_t tail = 0;
+        memcpy(&tail, data + body, bytes - body);
+        h = checksum_words(&tail, 8, h);
+    }
+    return h;
+}
+
+static void write_all(FILE *f, const void *data, size_t size, const char *path) {
+    if (fwrite(data, 1, size, f) != size) {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+/* Writes an instance to path in the binary instance format, returning the checksum
+   stored with it */
+uint64_t instance_save(const struct instance *inst, const char *path) {
+    size_t bytes = (size_t)inst->n * inst->n * inst->width;
+    struct instance_header h = {0};
+    memcpy(h.magic, INSTANCE_MAGIC, sizeof(h.magic));
+    h.version = INSTANCE_VERSION;
+    h.index_width = inst->width;
+    h.n = inst->n;
+    h.checksum = instance_checksum(inst);
+    h.seller_offset = INSTANCE_ALIGN;
+    h.buyer_offset = h.seller_offset + round_up(bytes, INSTANCE_ALIGN);
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    static const unsigned char zeros[INSTANCE_ALIGN];
+    write_all(f, &h, sizeof(h), path);
+    write_all(f, zeros, h.seller_offset - sizeof(h), path);
+    write_all(f, inst->seller_prefs.data, bytes, path);
+    write_all(f, zeros, h.buyer_offset - h.seller_offset - bytes, path);
+    write_all(f, inst->buyer_prefs.data, bytes, path);
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return h.checksum;
+}
+
+/* Maps the instance file at path read-only and points inst's preference lists
+   straight at the mapped matrices; nothing is copied. Exits with a message if the
+   file is not a valid instance, or if verify_checksum is set and the matrices do
+   not match the stored checksum or hold a list that is not a permutation. Without
+   verify_checksum the lists are trusted as they are. */
+void instance_load(struct instance *inst, const char *path, bool verify_checksum) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        fprintf(stderr, "Cannot stat %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    size_t size = (size_t)sb.st_size;
+    if (size < sizeof(struct instance_header)) {
+        fprintf(stderr, "%s is not an instance file\n", path);
+        exit(1);
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    struct instance_header h;
+    memcpy(&h, map, sizeof(h));
+    if (memcmp(h.magic, INSTANCE_MAGIC, sizeof(h.magic)) != 0 || h.version != INSTANCE_VERSION) {
+        fprintf(stderr, "%s is not a version %d instance file\n", path, INSTANCE_VERSION);
+        exit(1);
+    }
+    if (h.n == 0 || h.n > INT32_MAX || (h.index_width != 2 && h.index_width != 4)
+            || (int)h.index_width < index_width_for((int)h.n)) {
+        fprintf(stderr, "%s has an invalid header (n = %llu, index width %u)\n", path,
+                (unsigned long long)h.n, h.index_width);
+        exit(1);
+    }
+    uint64_t bytes = h.n * h.n * h.index_width;
+    if (h.seller_offset % INSTANCE_ALIGN != 0 || h.buyer_offset % INSTANCE_ALIGN != 0
+            || h.seller_offset < sizeof(h) || h.seller_offset > size || bytes > size - h.seller_offset
+            || h.buyer_offset > size || bytes > size - h.buyer_offset) {
+        fprintf(stderr, "%s is truncated or has invalid matrix offsets\n", path);
+        exit(1);
+    }
+
+    memset(inst, 0, sizeof(*inst));
+    inst->n = (int)h.n;
+    inst->width = (int)h.index_width;
+    inst->mapping = map;
+    inst->mapping_size = size;
+    inst->checksum = h.checksum;
+    inst->seller_prefs = (struct pref_matrix){ inst->n, inst->width, (char *)map + h.seller_offset };
+    inst->buyer_prefs = (struct pref_matrix){ inst->n, inst->width, (char *)map + h.buyer_offset };
+    madvise(map, size, MADV_WILLNEED);
+    if (!verify_checksum) {
+        return;
+    }
+    if (instance_checksum(inst) != h.checksum) {
+        fprintf(stderr, "%s: checksum mismatch, file is corrupt\n", path);
+        exit(1);
+    }
+    /* A matching checksum only shows the file is as it was written, so check too
+       that every list is a permutation, which the solvers index by without
+       bounds checks. The pages are already cached from the checksum pass. */
+    uint64_t *seen = alloc_array(((size_t)inst->n + 63) / 64, sizeof(uint64_t), "permutation check bitset");
+    const struct pref_matrix *matrices[2] = { &inst->seller_prefs, &inst->buyer_prefs };
+    for (int m = 0; m < 2; m++) {
+        int row = DISPATCH(inst->width, check_rows, matrices[m], seen);
+        if (row >= 0) {
+            fprintf(stderr, "%s: %s %d's list is not a permutation of 0 to %d\n", path, m == 0 ? "seller" : "buyer",
+                    row, inst->n - 1);
+            exit(1);
+        }
+    }
+    free(seen);
+}
+
+/* Snapshot files of a checkpointed solve. A header, then seller_next_choices,
+   seller_matches, buyer_matches and buyer_final_prefs, n entries each, and the
+   free seller stack from the bottom up, all 32-bit in host byte order. The
+   checksum covers those arrays; the instance checksum ties the snapshot to the
+   instance file it was taken on. */
+#define SNAPSHOT_MAGIC "SMSNAP\r\n"
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t n;
+    uint64_t top;                // free sellers on the stack
+    uint64_t instance_checksum;
+    uint64_t seed;               // of the run, for the record: solving draws no random numbers
+    uint64_t checksum;
+    struct solve_counters counters;
+};
+
+/* A snapshot's arrays, back to back in one buffer of 5n + 1 entries */
+static size_t snapshot_entries(const struct snapshot_header *h) {
+    return 4 * (size_t)h->n + h->top;
+}
+
+/* Checksum of the arrays in body. An odd number of entries is padded with a zero,
+   which the buffer has room for. */
+static uint64_t snapshot_checksum(const struct snapshot_header *h, int *body) {
+    size_t entries = snapshot_entries(h);
+    body[entries] = 0;
+    return checksum_words(body, round_up(entries * sizeof(int), 8), h->instance_checksum ^ h->top);
+}
+
+/* Snapshots are taken by copying the solver's state into a spare buffer, which a
+   background thread then owns until it has written it out. The solver never waits
+   for the writer: if a snapshot falls due while the last one is still being
+   written, it is put off to the next look at the clock. */
+struct checkpointer {
+    char *path;
+    char *tmp_path;               // written first, then renamed over path
+    uint64_t interval_ns;
+    uint64_t due_ns;              // when the solver next takes a copy
+    struct snapshot_header header;
+    int *body;
+    atomic_bool busy;             // the writer owns header and body
+    bool stopping;
+    uint64_t written;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+};
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Writes the copy in ck to a temporary file, syncs it, and renames it over the
+   snapshot path, so a crash mid-write leaves the previous snapshot intact */
+static bool snapshot_write(struct checkpointer *ck) {
+    ck->header.checksum = snapshot_checksum(&ck->header, ck->body);
+    size_t entries = snapshot_entries(&ck->header);
+    FILE *f = fopen(ck->tmp_path, "wb");
+    bool ok = f != NULL && fwrite(&ck->header, sizeof(ck->header), 1, f) == 1
+              && fwrite(ck->body, sizeof(int), entries, f) == entries
+              && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (f != NULL && fclose(f) != 0) {
+        ok = false;
+    }
+    if (ok && rename(ck->tmp_path, ck->path) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "Cannot write snapshot %s: %s\n", ck->path, strerror(errno));
+    }
+    return ok;
+}
+
+static void *checkpoint_writer(void *arg) {
+    struct checkpointer *ck = arg;
+    pthread_mutex_lock(&ck->lock);
+    for (;;) {
+        while (!atomic_load(&ck->busy) && !ck->stopping) {
+            pthread_cond_wait(&ck->wake, &ck->lock);
+        }
+        if (!atomic_load(&ck->busy)) {
+            break;
+        }
+        pthread_mutex_unlock(&ck->lock);
+        ck->written += snapshot_write(ck);
+        atomic_store(&ck->busy, false);
+        pthread_mutex_lock(&ck->lock);
+    }
+    pthread_mutex_unlock(&ck->lock);
+    return NULL;
+}
+
+/* Called by the solver between proposals, with top sellers on the free stack.
+   Copies the state to ck's buffer and wakes the writer if a snapshot is due and
+   the buffer is free. */
+static void checkpoint_poll(struct checkpointer *ck, const struct match_state *st, int top) {
+    uint64_t now = clock_ns();
+    if (now < ck->due_ns || atomic_load(&ck->busy)) {
+        return;
+    }
+    size_t n = (size_t)st->n;
+    memcpy(ck->body, st->seller_next_choices, n * sizeof(int));
+    memcpy(ck->body + n, st->seller_matches, n * sizeof(int));
+    memcpy(ck->body + 2 * n, st->buyer_matches, n * sizeof(int));
+    memcpy(ck->body + 3 * n, st->buyer_final_prefs, n * sizeof(int));
+    memcpy(ck->body + 4 * n, st->free_sellers, (size_t)top * sizeof(int));
+    ck->header.top = (uint64_t)top;
+    ck->header.counters = st->counters;
+    ck->due_ns = now + ck->interval_ns;
+    pthread_mutex_lock(&ck->lock);
+    atomic_store(&ck->busy, true);
+    pthread_cond_signal(&ck->wake);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+/* Starts a writer that will save snapshots of a solve for n a side to path, the
+   first after interval_ns. Exits if the writer cannot be started. */
+struct checkpointer *checkpoint_start(const char *path, int n, uint64_t interval_ns, uint64_t instance_checksum,
+                                      uint64_t seed) {
+    struct checkpointer *ck = alloc_array(1, sizeof(*ck), "checkpointer");
+    memset(ck, 0, sizeof(*ck));
+    size_t length = strlen(path);
+    // path and its terminator, then the same with ".tmp" appended
+    ck->path = alloc_array(2 * length + 6, 1, "snapshot path");
+    memcpy(ck->path, path, length + 1);
+    ck->tmp_path = ck->path + length + 1;
+    memcpy(ck->tmp_path, path, length);
+    memcpy(ck->tmp_path + length, ".tmp", 5);
+    ck->interval_ns = interval_ns;
+    ck->due_ns = clock_ns() + interval_ns;
+    memcpy(ck->header.magic, SNAPSHOT_MAGIC, sizeof(ck->header.magic));
+    ck->header.version = SNAPSHOT_VERSION;
+    ck->header.n = (uint64_t)n;
+    ck->header.instance_checksum = instance_checksum;
+    ck->header.seed = seed;
+    ck->body = alloc_array(5 * (size_t)n + 1, sizeof(int), "snapshot buffer");
+    mem_charge(MEM_OTHER, (5 * (uint64_t)n + 1) * sizeof(int));
+    atomic_init(&ck->busy, false);
+    pthread_mutex_init(&ck->lock, NULL);
+    pthread_cond_init(&ck->wake, NULL);
+    if (pthread_create(&ck->thread, NULL, checkpoint_writer, ck) != 0) {
+        fprintf(stderr, "Cannot start the snapshot writer for %s\n", path);
+        exit(1);
+    }
+    return ck;
+}
+
+/* Waits for any snapshot being written, stops the writer and frees ck. Returns the
+   number of snapshots written. */
+uint64_t checkpoint_stop(struct checkpointer *ck) {
+    pthread_mutex_lock(&ck->lock);
+    ck->stopping = true;
+    pthread_cond_signal(&ck->wake);
+    pthread_mutex_unlock(&ck->lock);
+    pthread_join(ck->thread, NULL);
+    uint64_t written = ck->written;
+    mem_release(MEM_OTHER, (5 * ck->header.n + 1) * sizeof(int));
+    pthread_mutex_destroy(&ck->lock);
+    pthread_cond_destroy(&ck->wake);
+    free(ck->body);
+    free(ck->path);
+    free(ck);
+    return written;
+}
+
+/* Restores st, allocated for n a side, from the snapshot at path, and returns the
+   number of sellers on its free stack. Exits with a message if the file is not a
+   valid snapshot or was taken on an instance with another checksum. */
+int snapshot_load(struct match_state *st, const char *path, uint64_t instance_checksum) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    struct snapshot_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0
+            || h.version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "%s is not a version %d snapshot file\n", path, SNAPSHOT_VERSION);
+        exit(1);
+    }
+    if (h.n != (uint64_t)st->n || h.top > h.n) {
+        fprintf(stderr, "%s is a snapshot of a solve with n = %llu, not %d\n", path,
+                (unsigned long long)h.n, st->n);
+        exit(1);
+    }
+    if (h.instance_checksum != instance_checksum) {
+        fprintf(stderr, "%s was taken on a different instance\n", path);
+        exit(1);
+    }
+    size_t n = (size_t)st->n;
+    size_t entries = snapshot_entries(&h);
+    int *body = alloc_array(5 * n + 1, sizeof(int), "snapshot buffer");
+    if (fread(body, sizeof(int), entries, f) != entries || fgetc(f) != EOF) {
+        fprintf(stderr, "%s is truncated or too long\n", path);
+        exit(1);
+    }
+    fclose(f);
+    if (snapshot_checksum(&h, body) != h.checksum) {
+        fprintf(stderr, "%s: checksum mismatch, file is corrupt\n", path);
+        exit(1);
+    }
+    for (size_t i = 0; i < entries; i++) {
+        int lowest = i < n || i >= 4 * n ? 0 : -1;
+        int highest = i < n ? st->n : st->n - 1;
+        if (body[i] < lowest || body[i] > highest) {
+            fprintf(stderr, "%s holds an out of range entry\n", path);
+            exit(1);
+        }
+    }
+    memcpy(st->seller_next_choices, body, n * sizeof(int));
+    memcpy(st->seller_matches, body + n, n * sizeof(int));
+    memcpy(st->buyer_matches, body + 2 * n, n * sizeof(int));
+    memcpy(st->buyer_final_prefs, body + 3 * n, n * sizeof(int));
+    memcpy(st->free_sellers, body + 4 * n, h.top * sizeof(int));
+    st->counters = h.counters;
+    free(body);
+    return (int)h.top;
+}
+
+/* Splits the index range [0, count) across nthreads threads (the caller being one
+   of them), calling body(arg, begin, end) on each piece. Pieces are handed out in
+   chunks from a shared counter, so a thread that finishes early takes more work
+   instead of idling. */
+struct parallel_for_job {
+    void (*body)(void *arg, int begin, int end);
+    void *arg;
+    int count;
+    int chunk;
+    atomic_int next;
+};
+
+static void *parallel_for_worker(void *p) {
+    struct parallel_for_job *job = p;
+    for (;;) {
+        int begin = atomic_fetch_add(&job->next, job->chunk);
+        if (begin >= job->count) {
+            return NULL;
+        }
+        int end = begin + job->chunk < job->count ? begin + job->chunk : job->count;
+        job->body(job->arg, begin, end);
+    }
+}
+
+/* Runs the pieces on the caller and up to nthreads - 1 threads, whose handles go in
+   threads. If a thread cannot be started, a lenient run carries on with however
+   many there are; a strict one hands out no more pieces, waits for the threads it
+   started and returns -1, leaving the work unfinished. */
+static int parallel_for_run(pthread_t *threads, bool strict, int nthreads, int count,
+                            void (*body)(void *arg, int begin, int end), void *arg) {
+    struct parallel_for_job job = { .body = body, .arg = arg, .count = count };
+    // A few chunks per thread balances load without contending on the counter
+    job.chunk = count / (nthreads * 8);
+    if (job.chunk < 1) {
+        job.chunk = 1;
+    }
+    atomic_init(&job.next, 0);
+    int started = 0;
+    bool failed = false;
+    for (; started < nthreads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, parallel_for_worker, &job) != 0) {
+            failed = strict;
+            break;
+        }
+    }
+    if (failed) {
+        atomic_store(&job.next, count);
+    } else {
+        parallel_for_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return failed ? -1 : 0;
+}
+
+void parallel_for(int nthreads, int count, void (*body)(void *arg, int begin, int end), void *arg) {
+    if (nthreads <= 1 || count <= 1) {
+        body(arg, 0, count);
+        return;
+    }
+    pthread_t *threads = alloc_array(nthreads - 1, sizeof(pthread_t), "thread handles");
+    parallel_for_run(threads, false, nthreads, count, body, arg);
+    free(threads);
+}
+
+/* parallel_for for the embedding API: the handles are the context's, grown when a
+   call asks for more threads than any before it, and running out of memory or
+   threads returns -1 with errno ENOMEM instead of exiting or carrying on */
+static int parallel_for_in(struct sm_context *ctx, int nthreads, int count,
+                           void (*body)(void *arg, int begin, int end), void *arg) {
+    if (nthreads <= 1 || count <= 1) {
+        body(arg, 0, count);
+        return 0;
+    }
+    if (nthreads - 1 > ctx->thread_capacity) {
+        pthread_t *threads = realloc(ctx->threads, (size_t)(nthreads - 1) * sizeof(pthread_t));
+        if (threads == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ctx->threads = threads;
+        ctx->thread_capacity = nthreads - 1;
+    }
+    if (parallel_for_run(ctx->threads, true, nthreads, count, body, arg) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/* Text instance files, in the shape the program prints its preference lists:
+
+       Pref lists - sellers
+       seller 0: 2 0 1
+       ...
+       Pref lists - buyers
+       buyer 0: 1 2 0
+       ...
+
+   The section headers and row labels are optional; without headers the first n rows
+   are the sellers' and the next n the buyers'. Numbers may be separated by spaces,
+   tabs or commas, n is taken from the length of the first row, and anything from a
+   "Matches" line on is ignored, so the program's own output can be fed back in. The
+   file is mapped when possible and scanned by hand rather than with scanf. */
+struct text_scanner {
+    const char *p;
+    const char *end;
+    const char *path;
+    int line;
+};
+
+static void text_error(const struct text_scanner *sc, const char *msg) {
+    fprintf(stderr, "%s:%d: %s\n", sc->path, sc->line, msg);
+    exit(1);
+}
+
+/* Skips separators within a line; stops at a newline or anything else */
+static void skip_separators(struct text_scanner *sc) {
+    while (sc->p < sc->end && (*sc->p == ' ' || *sc->p == '\t' || *sc->p == ','
+                               || *sc->p == '\r')) {
+        sc->p++;
+    }
+}
+
+static void skip_line(struct text_scanner *sc) {
+    while (sc->p < sc->end && *sc->p != '\n') {
+        sc->p++;
+    }
+}
+
+/* True if the rest of the current line starts with prefix */
+static bool line_starts_with(const struct text_scanner *sc, const char *prefix) {
+    size_t k = strlen(prefix);
+    return (size_t)(sc->end - sc->p) >= k && memcmp(sc->p, prefix, k) == 0;
+}
+
+/* Parses a non-negative decimal number that fits in an int */
+static int scan_number(struct text_scanner *sc) {
+    if (sc->p >= sc->end || !isdigit((unsigned char)*sc->p)) {
+        text_error(sc, "expected a number");
+    }
+    long long v = 0;
+    while (sc->p < sc->end && isdigit((unsigned char)*sc->p)) {
+        v = v * 10 + (*sc->p++ - '0');
+        if (v > INT32_MAX) {
+            text_error(sc, "number out of range");
+        }
+    }
+    return (int)v;
+}
+
+/* Parses the numbers on the rest of the current line into row, which has room for
+   capacity entries. Returns how many there were, or -1 if there were more. */
+static int scan_row(struct text_scanner *sc, int *row, int capacity) {
+    int count = 0;
+    for (;;) {
+        skip_separators(sc);
+        if (sc->p >= sc->end || *sc->p == '\n') {
+            return count;
+        }
+        if (count == capacity) {
+            return -1;
+        }
+        row[count++] = scan_number(sc);
+    }
+}
+
+/* Reads the whole file at path ("-" for standard input). Regular files are mapped;
+   anything else is read into a growing buffer. *mapped says which was done. */
+static char *read_text_file(const char *path, size_t *size, bool *mapped) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        void *map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)sb.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            *size = (size_t)sb.st_size;
+            *mapped = true;
+            return map;
+        }
+    }
+    size_t capacity = 1 << 20;
+    size_t len = 0;
+    char *buf = malloc(capacity);
+    for (;;) {
+        if (buf == NULL) {
+            fprintf(stderr, "Out of memory reading %s\n", path);
+            exit(1);
+        }
+        ssize_t got = read(fd, buf + len, capacity - len);
+        if (got < 0) {
+            fprintf(stderr, "Cannot read %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        if (got == 0) {
+            break;
+        }
+        len += (size_t)got;
+        if (len == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity);
+        }
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    *size = len;
+    *mapped = false;
+    return buf;
+}
+
+/* Parses a text instance file into a heap-allocated instance. width is the index
+   width to store it with, or 0 for the narrowest that fits. Every row is checked to
+   be a permutation of 0..n-1. */
+void instance_load_text(struct instance *inst, const char *path, int width) {
+    size_t size;
+    bool mapped;
+    char *text = read_text_file(path, &size, &mapped);
+    struct text_scanner sc = { text, text + size, path, 1 };
+
+    enum { NO_SECTION = -1, SELLERS = 0, BUYERS = 1 } section = NO_SECTION;
+    bool saw_headers = false;
+    int rows[2] = {0, 0};   // rows read so far for each side
+    int n = -1;             // unknown until the first row is read
+    int capacity = 1024;
+    int *scratch = malloc(capacity * sizeof(int));
+    uint64_t *seen = NULL;
+    static const char *const side_names[2] = {"seller", "buyer"};
+
+    while (sc.p < sc.end) {
+        skip_separators(&sc);
+        if (sc.p < sc.end && *sc.p == '\n') {
+            sc.p++;
+            sc.line++;
+            continue;
+        }
+        if (sc.p >= sc.end) {
+            break;
+        }
+        int side;
+        int label = -1;
+        if (!isdigit((unsigned char)*sc.p)) {
+            if (line_starts_with(&sc, "Pref lists - sellers")) {
+                section = SELLERS;
+                saw_headers = true;
+                skip_line(&sc);
+                continue;
+            } else if (line_starts_with(&sc, "Pref lists - buyers")) {
+                section = BUYERS;
+                saw_headers = true;
+                skip_line(&sc);
+                continue;
+            } else if (line_starts_with(&sc, "Matches")) {
+                break;
+            }
+            // A row label, "seller <i>:" or "buyer <i>:"
+            if (line_starts_with(&sc, "seller ")) {
+                side = SELLERS;
+                sc.p += strlen("seller ");
+            } else if (line_starts_with(&sc, "buyer ")) {
+                side = BUYERS;
+                sc.p += strlen("buyer ");
+            } else {
+                text_error(&sc, "expected a preference row");
+            }
+            if (saw_headers && side != (int)section) {
+                text_error(&sc, "row label does not match its section");
+            }
+            label = scan_number(&sc);
+            skip_separators(&sc);
+            if (sc.p >= sc.end || *sc.p != ':') {
+                text_error(&sc, "expected ':' after the row label");
+            }
+            sc.p++;
+        } else if (saw_headers) {
+            if (section == NO_SECTION) {
+                text_error(&sc, "preference row before any section header");
+            }
+            side = section;
+        } else {
+            side = n < 0 || rows[SELLERS] < n ? SELLERS : BUYERS;
+        }
+
+        int count;
+        if (n < 0) {
+            // The first row fixes n, so let the scratch row grow until we know it
+            const char *row_start = sc.p;
+            for (;;) {
+                struct text_scanner probe = sc;
+                count = scan_row(&probe, scratch, capacity);
+                if (count >= 0) {
+                    sc = probe;
+                    break;
+                }
+                capacity *= 2;
+                scratch = realloc(scratch, capacity * sizeof(int));
+                if (scratch == NULL) {
+                    fprintf(stderr, "Out of memory reading %s\n", path);
+                    exit(1);
+                }
+                sc.p = row_start;
+            }
+            if (count == 0) {
+                text_error(&sc, "empty preference row");
+            }
+            n = count;
+            if (width == 0) {
+                width = index_width_for(n);
+            } else if (width < index_width_for(n)) {
+                fprintf(stderr, "n = %d does not fit in 16-bit indices\n", n);
+                exit(1);
+            }
+            instance_alloc(inst, n, width);
+            seen = alloc_array(((size_t)n + 63) / 64, sizeof(uint64_t), "permutation check bitset");
+        } else {
+            count = scan_row(&sc, scratch, n);
+            if (count < 0) {
+                text_error(&sc, "row is longer than the first row");
+            }
+        }
+
+        if (rows[side] >= n) {
+            text_error(&sc, side == SELLERS ? "more seller rows than n" : "more buyer rows than n");
+        }
+        if (label >= 0 && label != rows[side]) {
+            text_error(&sc, "rows must be numbered 0 to n-1 in order");
+        }
+        if (count != n) {
+            text_error(&sc, "row length differs from the first row");
+        }
+        struct pref_matrix *m = side == SELLERS ? &inst->seller_prefs : &inst->buyer_prefs;
+        for (int j = 0; j < n; j++) {
+            if (scratch[j] >= n) {
+                text_error(&sc, "id out of range 0..n-1");
+            }
+        }
+        DISPATCH(width, store_row, m, rows[side], scratch);
+        const void *row = (const char *)m->data + (size_t)rows[side] * n * width;
+        if (DISPATCH(width, check_permutation, row, n, seen) >= 0) {
+            fprintf(stderr, "%s:%d: %s %d's list is not a permutation of 0..%d\n", path, sc.line,
+                    side_names[side], rows[side], n - 1);
+            exit(1);
+        }
+        rows[side]++;
+    }
+
+    if (n < 0) {
+        fprintf(stderr, "%s: no preference rows\n", path);
+        exit(1);
+    }
+    if (rows[SELLERS] != n || rows[BUYERS] != n) {
+        fprintf(stderr, "%s: expected %d seller and %d buyer rows, found %d and %d\n", path,
+                n, n, rows[SELLERS], rows[BUYERS]);
+        exit(1);
+    }
+    free(scratch);
+    free(seen);
+    if (mapped) {
+        munmap(text, size);
+    } else {
+        free(text);
+    }
+}
+
+struct generate_job {
+    struct instance *inst;
+    uint64_t seed;
+};
+
+static void generate_body(void *arg, int begin, int end) {
+    struct generate_job *job = arg;
+    DISPATCH(job->inst->width, generate_rows, job->inst, job->seed, begin, end);
+}
+
+/* Fills both sides' preference lists with a random instance, using nthreads threads */
+void generate_random(struct instance *inst, uint64_t seed, int nthreads) {
+    struct generate_job job = { inst, seed };
+    parallel_for(nthreads, inst->n, generate_body, &job);
+}
+
+/* Instance generators. A generator's prepare builds whatever its rows share once
+   per instance, and its rows callback fills disjoint ranges of rows on every
+   thread. Rows draw from their usual streams, so every generator's instance depends
+   only on the seed, whatever the thread count. */
+
+static void uniform_rows(struct instance *inst, uint64_t seed, const void *shared, int begin, int end) {
+    (void)shared;
+    DISPATCH(inst->width, generate_rows, inst, seed, begin, end);
+}
+
+/* Shared state of the master list generators: each side's master list, a random
+   permutation of the other side, and how its rows derive from it */
+struct master_lists {
+    int spreads[2];  // negative for a side whose rows are shuffled independently
+    int *lists[2];
+};
+
+static void *prepare_masters(const struct instance *inst, uint64_t seed, int seller_spread, int buyer_spread) {
+    int n = inst->n;
+    struct master_lists *m = alloc_array(1, sizeof(*m) + 2 * (size_t)n * sizeof(int), "master lists");
+    m->spreads[0] = seller_spread;
+    m->spreads[1] = buyer_spread;
+    for (int side = 0; side < 2; side++) {
+        m->lists[side] = (int *)(m + 1) + (size_t)side * n;
+        struct rng rng;
+        rng_seed(&rng, seed, MASTER_STREAM(n, side));
+        for (int i = 0; i < n; i++) {
+            m->lists[side][i] = i;
+        }
+        for (int i = n - 1; i > 0; i--) {
+            int j = (int)rng_below(&rng, (uint32_t)i + 1);
+            int t = m->lists[side][j];
+            m->lists[side][j] = m->lists[side][i];
+            m->lists[side][i] = t;
+        }
+    }
+    return m;
+}
+
+static void master_rows(struct instance *inst, uint64_t seed, const void *shared, int begin, int end) {
+    const struct master_lists *m = shared;
+    int n = inst->n;
+    int spread = m->spreads[0] > m->spreads[1] ? m->spreads[0] : m->spreads[1];
+    uint32_t *keys = alloc_array(n, sizeof(uint32_t), "master row keys");
+    int *counts = alloc_array((size_t)n + (spread > 0 ? spread : 0), sizeof(int), "master row counts");
+    const int *lists[2] = { m->lists[0], m->lists[1] };
+    DISPATCH(inst->width, generate_master_rows, inst, seed, lists, m->spreads, keys, counts, begin, end);
+    free(keys);
+    free(counts);
+}
+
+static void *prepare_identical(const struct instance *inst, uint64_t seed) {
+    return prepare_masters(inst, seed, 0, -1);
+}
+
+static void *prepare_master(const struct instance *inst, uint64_t seed) {
+    return prepare_masters(inst, seed, 0, 0);
+}
+
+static void *prepare_popularity(const struct instance *inst, uint64_t seed) {
+    return prepare_masters(inst, seed, inst->n / 4 + 2, inst->n / 4 + 2);
+}
+
+/* Every seller shares one list and every buyer ranks the sellers by descending id.
+   The solvers start the sellers in ascending id order, so each buyer keeps being
+   offered someone they prefer to their holder, and almost every one of the
+   n(n+1)/2 proposals displaces a seller. */
+static void *prepare_adversarial(const struct instance *inst, uint64_t seed) {
+    struct master_lists *m = prepare_masters(inst, seed, 0, 0);
+    for (int i = 0; i < inst->n; i++) {
+        m->lists[1][i] = inst->n - 1 - i;
+    }
+    return m;
+}
+
+/* Shared state of the correlated generator: each participant's base score. A lower
+   score is more desirable. */
+struct base_scores {
+    uint32_t *scores[2];  // scores[0] of buyers, which sellers rank, and scores[1] of sellers
+};
+
+static void *prepare_correlated(const struct instance *inst, uint64_t seed) {
+    int n = inst->n;
+    struct base_scores *b = alloc_array(1, sizeof(*b) + 2 * (size_t)n * sizeof(uint32_t), "base scores");
+    for (int side = 0; side < 2; side++) {
+        b->scores[side] = (uint32_t *)(b + 1) + (size_t)side * n;
+        struct rng rng;
+        rng_seed(&rng, seed, MASTER_STREAM(n, side));
+        for (int i = 0; i < n; i++) {
+            b->scores[side][i] = (uint32_t)(rng_next(&rng) >> 33);
+        }
+    }
+    return b;
+}
+
+static void correlated_rows(struct instance *inst, uint64_t seed, const void *shared, int begin, int end) {
+    const struct base_scores *b = shared;
+    int n = inst->n;
+    uint64_t *keys = alloc_array(2 * (size_t)n, sizeof(uint64_t), "correlated row keys");
+    const uint32_t *scores[2] = { b->scores[0], b->scores[1] };
+    DISPATCH(inst->width, generate_correlated_rows, inst, seed, scores, keys, begin, end);
+    free(keys);
+}
+
+static const struct instance_generator builtin_generators[] = {
+    { "uniform", NULL, uniform_rows },
+    { "identical", prepare_identical, master_rows },
+    { "master", prepare_master, master_rows },
+    { "popularity", prepare_popularity, master_rows },
+    { "adversarial", prepare_adversarial, master_rows },
+    { "correlated", prepare_correlated, correlated_rows },
+};
+
+/* The built-in generator of the given name, or NULL if there is none:
+   - uniform: every list an independent uniformly random permutation;
+   - identical: every seller has the sellers' master list and every buyer a
+     random list, for n(n+1)/2 proposals;
+   - master: every seller has one list and every buyer another;
+   - popularity: everyone has a copy of their side's master list with each entry
+     pushed back by up to n/4 places, so people broadly agree on who is desirable;
+   - adversarial: as identical, with buyers all ranking sellers by descending id
+     so nearly every proposal breaks an engagement;
+   - correlated: each participant has a base score, and each row ranks the other
+     side by base score plus independent noise of half the base range. */
+const struct instance_generator *find_generator(const char *name) {
+    for (size_t i = 0; i < sizeof(builtin_generators) / sizeof(builtin_generators[0]); i++) {
+        if (strcmp(builtin_generators[i].name, name) == 0) {
+            return &builtin_generators[i];
+        }
+    }
+    return NULL;
+}
+
+struct generator_job {
+    const struct instance_generator *gen;
+    struct instance *inst;
+    uint64_t seed;
+    const void *shared;
+};
+
+static void generator_body(void *arg, int begin, int end) {
+    struct generator_job *job = arg;
+    job->gen->rows(job->inst, job->seed, job->shared, begin, end);
+}
+
+/* Fills both sides' preference lists from gen, using nthreads threads */
+void generate_with(struct instance *inst, const struct instance_generator *gen, uint64_t seed, int nthreads) {
+    void *shared = gen->prepare != NULL ? gen->prepare(inst, seed) : NULL;
+    struct generator_job job = { gen, inst, seed, shared };
+    parallel_for(nthreads, inst->n, generator_body, &job);
+    free(shared);
+}
+
+struct rank_job {
+    const struct pref_matrix *prefs;
+    struct pref_matrix *rank;
+};
+
+static void rank_body(void *arg, int begin, int end) {
+    struct rank_job *job = arg;
+    DISPATCH(job->prefs->width, build_rank_rows, job->prefs, job->rank, begin, end);
+}
+
+/* Builds inst->buyer_rank from the buyers' preference lists, using nthreads threads */
+void build_rank_table(struct instance *inst, int nthreads) {
+    struct rank_job job = { &inst->buyer_prefs, &inst->buyer_rank };
+    parallel_for(nthreads, inst->n, rank_body, &job);
+}
+
+/* Builds inst->seller_rank from the sellers' preference lists, the table buyers
+   need when they propose */
+void build_seller_rank_table(struct instance *inst, int nthreads) {
+    struct rank_job job = { &inst->seller_prefs, &inst->seller_rank };
+    parallel_for(nthreads, inst->n, rank_body, &job);
+}
+
+/* Sum of n ints, for the statistics over a finished match state. The widest vector
+   version the CPU supports is chosen at run time, with a scalar loop elsewhere. */
+static int64_t sum_ints_scalar(const int *a, int n) {
+    int64_t total = 0;
+    for (int i = 0; i < n; i++) {
+        total += a[i];
+    }
+    return total;
+}
+
+#ifdef SM_X86_KERNELS
+__attribute__((target("avx2")))
+static int64_t sum_ints_avx2(const int *a, int n) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum_ints_scalar(a + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static int64_t sum_ints_avx512(const int *a, int n) {
+    __m512i acc = _mm512_setzero_si512();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i v = _mm512_loadu_si512(a + i);
+        acc = _mm512_add_epi64(acc, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(v)));
+        acc = _mm512_add_epi64(acc, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+    }
+    return _mm512_reduce_add_epi64(acc) + sum_ints_scalar(a + i, n - i);
+}
+#endif
+
+int64_t sum_ints(const int *a, int n) {
+#ifdef SM_X86_KERNELS
+    if (__builtin_cpu_supports("avx512f")) {
+        return sum_ints_avx512(a, n);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return sum_ints_avx2(a, n);
+    }
+#endif
+    return sum_ints_scalar(a, n);
+}
+
+/* Total number of proposals made. Every proposal advances the proposing seller's
+   next choice by one, so this is exact whether or not counters are compiled in. */
+uint64_t count_proposals(const struct match_state *st) {
+    return (uint64_t)sum_ints(st->seller_next_choices, st->n);
+}
+
+/* Returns true if no check failed; otherwise prints what failed and returns false */
+static bool report_verify_result(const struct verify_result *v) {
+    if (!atomic_load(&v->failed)) {
+        return true;
+    }
+    if (v->failure == VERIFY_NOT_PERFECT) {
+        fprintf(stderr, "Verification failed: seller %d is matched to buyer %d, who is not matched back\n",
+                v->seller, v->buyer);
+    } else if (v->failure == VERIFY_BLOCKING_PAIR) {
+        fprintf(stderr, "Verification failed: seller %d and buyer %d would both rather be together\n",
+                v->seller, v->buyer);
+    } else {
+        fprintf(stderr, "Verification failed: buyer %d holds seller %d, who is matched elsewhere\n",
+                v->buyer, v->seller);
+    }
+    return false;
+}
+
+struct verify_job {
+    const struct instance *inst;
+    const struct match_state *st;
+    struct verify_result result;
+};
+
+static void verify_body(void *arg, int begin, int end) {
+    struct verify_job *job = arg;
+    DISPATCH(job->inst->width, verify_sellers, job->inst, job->st, begin, end, &job->result);
+}
+
+/* Checks that st holds a perfect, stable matching of inst, splitting the sellers
+   across nthreads threads. Needs inst->buyer_rank. Returns true if it does; if not,
+   prints the first problem found and returns false. */
+bool verify_matching(const struct instance *inst, const struct match_state *st, int nthreads) {
+    struct verify_job job = { .inst = inst, .st = st };
+    atomic_init(&job.result.failed, false);
+    parallel_for(nthreads, inst->n, verify_body, &job);
+    return report_verify_result(&job.result);
+}
+
+/* Allocates heaps for n buyers with the given capacities, which must stay valid
+   while the heaps are in use */
+void buyer_heaps_alloc(struct buyer_heaps *heaps, int n, const int *capacities) {
+    heaps->n = n;
+    heaps->capacities = capacities;
+    heaps->offsets = alloc_array((size_t)n + 1, sizeof(size_t), "buyer heap offsets");
+    heaps->offsets[0] = 0;
+    for (int b = 0; b < n; b++) {
+        heaps->offsets[b + 1] = heaps->offsets[b] + capacities[b];
+    }
+    heaps->sizes = alloc_array(n, sizeof(int), "buyer heap sizes");
+    heaps->entries = alloc_array(heaps->offsets[n], sizeof(uint64_t), "buyer heaps");
+    mem_charge(MEM_OTHER, buyer_heaps_footprint(n, heaps->offsets[n]));
+}
+
+void buyer_heaps_free(struct buyer_heaps *heaps) {
+    mem_release(MEM_OTHER, buyer_heaps_footprint(heaps->n, heaps->offsets[heaps->n]));
+    free(heaps->offsets);
+    free(heaps->sizes);
+    free(heaps->entries);
+}
+
+/* Finds the seller-optimal many-to-one stable matching of inst, starting from the
+   state in st, with each buyer's holders in heaps. Needs inst->buyer_rank. */
+void solve_capacitated(const struct instance *inst, struct match_state *st, struct buyer_heaps *heaps) {
+    DISPATCH(inst->width, solve_capacitated, inst, st, heaps);
+}
+
+struct capacitated_verify_job {
+    const struct instance *inst;
+    const struct match_state *st;
+    const struct buyer_heaps *heaps;
+    struct verify_result result;
+};
+
+static void capacitated_verify_body(void *arg, int begin, int end) {
+    struct capacitated_verify_job *job = arg;
+    DISPATCH(job->inst->width, verify_capacitated_sellers, job->inst, job->st, job->heaps, begin, end,
+             &job->result);
+}
+
+/* Checks that st and heaps hold a stable many-to-one matching of inst: every
+   seller is held by their buyer, no buyer holds more sellers than matched to them
+   or than their capacity, and no buyer with room or with a holder they like less
+   is ranked by a seller above their own buyer. Needs inst->buyer_rank. */
+bool verify_capacitated(const struct instance *inst, const struct match_state *st,
+                        const struct buyer_heaps *heaps, int nthreads) {
+    struct capacitated_verify_job job = { .inst = inst, .st = st, .heaps = heaps };
+    atomic_init(&job.result.failed, false);
+    parallel_for(nthreads, inst->n, capacitated_verify_body, &job);
+    for (int b = 0; b < inst->n && !atomic_load(&job.result.failed); b++) {
+        const uint64_t *heap = heaps->entries + heaps->offsets[b];
+        for (int i = 0; i < heaps->sizes[b]; i++) {
+            int s = (int)(uint32_t)heap[i];
+            if (heaps->sizes[b] > heaps->capacities[b] || st->seller_matches[s] != b) {
+                verify_fail(&job.result, VERIFY_NOT_HELD_BACK, s, b);
+                break;
+            }
+        }
+    }
+    return report_verify_result(&job.result);
+}
+
+/* Puts st back in its starting state: nobody matched, and every seller's next
+   proposal to their favorite buyer */
+void match_state_reset(struct match_state *st) {
+    for (int i = 0; i < st->n; i++) {
+        st->seller_next_choices[i] = 0;
+        st->buyer_final_prefs[i] = -1;
+        st->seller_matches[i] = -1;
+        st->buyer_matches[i] = -1;
+    }
+    memset(&st->counters, 0, sizeof(st->counters));
+}
+
+/* Re-solves st, a finished seller-proposing solve of inst, after the preference
+   lists of the given sellers and buyers were changed in place, breaking only the
+   engagements the change invalidates. Needs both rank tables, whose changed rows it
+   brings up to date. Returns the number of proposals and repairs it made. */
+uint64_t resolve_changed(struct instance *inst, struct match_state *st, const int *sellers, int nsellers,
+                         const int *buyers, int nbuyers) {
+    size_t words = ((size_t)inst->n + 63) / 64;
+    uint64_t *queued = alloc_array(words, sizeof(uint64_t), "re-solve scratch");
+    memset(queued, 0, words * sizeof(uint64_t));
+    uint64_t work = DISPATCH(inst->width, resolve, inst, st, sellers, nsellers, buyers, nbuyers, queued);
+    free(queued);
+    return work;
+}
+
+/* For --perturb: replaces k rows, each a random seller's or buyer's list, with new
+   random lists drawn from the seed's perturbation stream, and records which rows
+   changed. sellers and buyers need room for k entries each; a row drawn twice is
+   listed twice. */
+void perturb_rows(struct instance *inst, uint64_t seed, int k, int *sellers, int *nsellers,
+                  int *buyers, int *nbuyers) {
+    struct rng rng;
+    rng_seed(&rng, seed, PERTURB_STREAM(inst->n));
+    *nsellers = *nbuyers = 0;
+    for (int i = 0; i < k; i++) {
+        uint32_t r = rng_below(&rng, 2 * (uint32_t)inst->n);
+        if (r < (uint32_t)inst->n) {
+            sellers[(*nsellers)++] = (int)r;
+            DISPATCH(inst->width, shuffle_row, &rng, &inst->seller_prefs, (int)r);
+        } else {
+            buyers[(*nbuyers)++] = (int)(r - inst->n);
+            DISPATCH(inst->width, shuffle_row, &rng, &inst->buyer_prefs, (int)(r - inst->n));
+        }
+    }
+}
+
+/* Allocates the per-participant arrays of st for n a side, then resets it */
+void match_state_alloc(struct match_state *st, int n) {
+    *st = (struct match_state){
+        .n = n,
+        .seller_next_choices = alloc_array(n, sizeof(int), "seller next choices"),
+        .buyer_final_prefs = alloc_array(n, sizeof(int), "buyer final ranks"),
+        .seller_matches = alloc_array(n, sizeof(int), "seller matches"),
+        .buyer_matches = alloc_array(n, sizeof(int), "buyer matches"),
+        .free_sellers = alloc_array(n, sizeof(int), "free seller list"),
+    };
+    mem_charge(MEM_MATCH, match_state_bytes(n, n));
+    match_state_reset(st);
+}
+
+static void free_match_arrays(struct match_state *st) {
+    free(st->seller_next_choices);
+    free(st->buyer_final_prefs);
+    free(st->seller_matches);
+    free(st->buyer_matches);
+    free(st->free_sellers);
+}
+
+/* Frees the arrays of st, which match_state_alloc allocated */
+void match_state_free(struct match_state *st) {
+    mem_release(MEM_MATCH, match_state_bytes(st->n, st->n));
+    free_match_arrays(st);
+}
+
+/* LIFO rank solve of inst from st with top sellers on its free stack, as
+   snapshot_load leaves it, or from the starting state if top is negative. With ck,
+   the solve hands ck a copy of its state every interval. Needs buyer_rank. */
+void solve_checkpointed(const struct instance *inst, struct match_state *st, int top, struct checkpointer *ck) {
+    if (top < 0) {
+        top = 0;
+        for (int i = st->n - 1; i >= 0; i--) {
+            st->free_sellers[top++] = i;
+        }
+    }
+    DISPATCH(inst->width, solve_checkpointed, inst, st, top, ck);
+}
+
+struct concurrent_job {
+    const struct instance *inst;
+    struct match_state *st;
+    _Atomic uint64_t *holders;
+};
+
+static void concurrent_body(void *arg, int begin, int end) {
+    struct concurrent_job *job = arg;
+    DISPATCH(job->inst->width, solve_concurrent, job->inst, job->st, job->holders, begin, end);
+}
+
+/* Solves with concurrent proposals from nthreads threads, then unpacks the buyers'
+   final holders into the usual match arrays. Needs inst->buyer_rank. */
+static void holders_reset(_Atomic uint64_t *holders, int n) {
+    for (int b = 0; b < n; b++) {
+        atomic_init(&holders[b], HOLDER_NONE);
+    }
+}
+
+static void holders_unpack(const _Atomic uint64_t *holders, struct match_state *st, int n) {
+    for (int b = 0; b < n; b++) {
+        uint64_t held = atomic_load_explicit(&holders[b], memory_order_relaxed);
+        int seller = (int)(uint32_t)held;
+        st->buyer_matches[b] = seller;
+        st->buyer_final_prefs[b] = (int)(held >> 32);
+        st->seller_matches[seller] = b;
+    }
+}
+
+void solve_parallel(const struct instance *inst, struct match_state *st, int nthreads) {
+    int n = inst->n;
+    _Atomic uint64_t *holders = alloc_array(n, sizeof(*holders), "buyer holders");
+    holders_reset(holders, n);
+    struct concurrent_job job = { inst, st, holders };
+    parallel_for(nthreads, n, concurrent_body, &job);
+    holders_unpack(holders, st, n);
+    free(holders);
+}
+
+bool needs_rank_table(enum solver_mode mode) {
+    return mode != SOLVER_SCAN;
+}
+
+/* Solves inst from the starting state in st with the chosen solver. nthreads only
+   matters to the parallel solver; the others are serial. */
+void run_solver(const struct instance *inst, enum solver_mode mode, enum schedule schedule,
+                int nthreads, struct match_state *st) {
+    if (mode == SOLVER_PARALLEL) {
+        solve_parallel(inst, st, nthreads);
+    } else if (mode == SOLVER_PIPELINED) {
+        DISPATCH(inst->width, solve_pipelined, inst, st);
+    } else {
+        DISPATCH(inst->width, solve, inst, mode, schedule, st);
+    }
+}
+
+/* Stable matching lattices */
+
+static size_t rotation_poset_bytes(const struct rotation_poset *p) {
+    size_t pairs = p->offsets[p->count];
+    return (p->count + 1) * 2 * sizeof(size_t) + pairs * 2 * sizeof(int) + p->count * 2 * sizeof(int64_t)
+           + p->pred_offsets[p->count] * sizeof(int);
+}
+
+/* Builds the rotation poset of inst from its seller-optimal and buyer-optimal
+   matchings. Needs both rank tables. Finding the rotations takes O(n^2) time in
+   all; ordering them costs a bisection for each buyer a rotation moves a seller
+   past, of which there are at most n^2. */
+void rotation_poset_build(struct rotation_poset *p, const struct instance *inst, const int *seller_optimal,
+                          const int *buyer_optimal) {
+    int n = inst->n;
+    int *matches = alloc_array(n, sizeof(int), "rotation walk");
+    int *held = alloc_array(n, sizeof(int), "rotation walk");
+    memcpy(matches, seller_optimal, (size_t)n * sizeof(int));
+    for (int s = 0; s < n; s++) {
+        held[matches[s]] = s;
+    }
+    struct rotation_lists lists = {0};
+    size_list_push(&lists.ends, 0);
+    DISPATCH(inst->width, find_rotations, inst, buyer_optimal, matches, held, &lists);
+    free(matches);
+    free(held);
+
+    memset(p, 0, sizeof(*p));
+    p->n = n;
+    p->count = (int)lists.ends.count - 1;
+    p->offsets = lists.ends.items;
+    p->sellers = lists.sellers.items;
+    p->buyers = lists.buyers.items;
+    p->seller_delta = alloc_array(p->count + 1, sizeof(int64_t), "rotation costs");
+    p->buyer_delta = alloc_array(p->count + 1, sizeof(int64_t), "rotation costs");
+    DISPATCH(inst->width, matching_costs, inst, seller_optimal, &p->seller_cost, &p->buyer_cost);
+    DISPATCH(inst->width, rotation_precedence, inst, p, seller_optimal, &lists);
+
+    /* Gather each rotation's predecessors from the (before, after) edges, dropping
+       repeats */
+    size_t nedges = lists.edges.count / 2;
+    const int *edges = lists.edges.items;
+    p->pred_offsets = alloc_array((size_t)p->count + 1, sizeof(size_t), "rotation order");
+    p->preds = alloc_array(nedges + 1, sizeof(int), "rotation order");
+    memset(p->pred_offsets, 0, ((size_t)p->count + 1) * sizeof(size_t));
+    for (size_t e = 0; e < nedges; e++) {
+        p->pred_offsets[edges[2 * e + 1] + 1]++;
+    }
+    for (int r = 0; r < p->count; r++) {
+        p->pred_offsets[r + 1] += p->pred_offsets[r];
+    }
+    size_t *fill = alloc_array((size_t)p->count + 1, sizeof(size_t), "rotation order");
+    memcpy(fill, p->pred_offsets, ((size_t)p->count + 1) * sizeof(size_t));
+    for (size_t e = 0; e < nedges; e++) {
+        p->preds[fill[edges[2 * e + 1]]++] = edges[2 * e];
+    }
+    free(fill);
+    int *seen = alloc_array((size_t)p->count + 1, sizeof(int), "rotation order");  // last rotation listing each
+    for (int r = 0; r < p->count; r++) {
+        seen[r] = -1;
+    }
+    size_t kept = 0;
+    for (int r = 0; r < p->count; r++) {
+        size_t begin = p->pred_offsets[r];
+        p->pred_offsets[r] = kept;
+        for (size_t i = begin; i < p->pred_offsets[r + 1]; i++) {
+            int q = p->preds[i];
+            if (seen[q] != r) {
+                seen[q] = r;
+                p->preds[kept++] = q;
+            }
+        }
+    }
+    p->pred_offsets[p->count] = kept;
+    free(seen);
+    free(lists.edges.items);
+    mem_charge(MEM_OTHER, rotation_poset_bytes(p));
+}
+
+void rotation_poset_free(struct rotation_poset *p) {
+    mem_release(MEM_OTHER, rotation_poset_bytes(p));
+    free(p->offsets);
+    free(p->sellers);
+    free(p->buyers);
+    free(p->seller_delta);
+    free(p->buyer_delta);
+    free(p->pred_offsets);
+    free(p->preds);
+}
+
+/* Eliminates rotation r from matches, or with undo puts it back */
+static void rotation_apply(const struct rotation_poset *p, int r, int *matches, bool undo) {
+    size_t begin = p->offsets[r];
+    size_t end = p->offsets[r + 1];
+    for (size_t i = begin; i < end; i++) {
+        matches[p->sellers[i]] = undo ? p->buyers[i] : p->buyers[i + 1 < end ? i + 1 : begin];
+    }
+}
+
+enum { ROTATION_EXCLUDED, ROTATION_INCLUDED };
+
+/* Lists the closed sets of rotations by backtracking over the rotations in index
+   order, deciding each one's membership: leaving it out first, then putting it in
+   if all its predecessors are. Every branch reaches a closed set, so matchings come
+   out one per O(number of rotations) steps at worst, with only the current one in
+   memory, however many there are. */
+uint64_t stable_matchings(const struct rotation_poset *p, const int *seller_optimal, uint64_t limit,
+                          bool (*visit)(void *arg, const int *matches, int64_t seller_cost, int64_t buyer_cost),
+                          void *arg, bool *exhausted) {
+    int *matches = alloc_array(p->n, sizeof(int), "stable matching");
+    *exhausted = false;
+    memcpy(matches, seller_optimal, (size_t)p->n * sizeof(int));
+    unsigned char *state = alloc_array((size_t)p->count + 1, 1, "rotation choices");
+    int64_t seller_cost = p->seller_cost;
+    int64_t buyer_cost = p->buyer_cost;
+    uint64_t visited = 0;
+    int r = 0;
+    for (;;) {
+        if (r < p->count) {
+            state[r++] = ROTATION_EXCLUDED;
+            continue;
+        }
+        visited++;
+        if (!visit(arg, matches, seller_cost, buyer_cost)) {
+            break;
+        }
+        /* Back up to the latest rotation left out that could be put in instead. At
+           the limit this only looks for whether there is another matching. */
+        bool found = false;
+        while (!found && --r >= 0) {
+            if (state[r] == ROTATION_INCLUDED) {
+                rotation_apply(p, r, matches, true);
+                seller_cost -= p->seller_delta[r];
+                buyer_cost -= p->buyer_delta[r];
+                continue;
+            }
+            found = true;
+            for (size_t i = p->pred_offsets[r]; i < p->pred_offsets[r + 1] && found; i++) {
+                found = state[p->preds[i]] == ROTATION_INCLUDED;
+            }
+        }
+        if (!found) {
+            *exhausted = true;
+            break;
+        }
+        if (visited == limit) {
+            break;
+        }
+        state[r] = ROTATION_INCLUDED;
+        rotation_apply(p, r, matches, false);
+        seller_cost += p->seller_delta[r];
+        buyer_cost += p->buyer_delta[r];
+        r++;
+    }
+    free(state);
+    free(matches);
+    return visited;
+}
+
+/* Flow network for the egalitarian matching's minimum cut. Edges come in pairs, an
+   edge and its reverse, so e ^ 1 is the other of the pair. */
+struct flow_network {
+    int nodes;
+    size_t edges;
+    size_t *head;    // each node's first edge, or SIZE_MAX; edges are chained by next
+    size_t *next;
+    int *to;
+    int64_t *cap;
+    int *level;      // distance from the source in the current level graph, or -1
+    size_t *cursor;  // next edge each node's search will try, this phase
+    size_t *path;
+    int *queue;
+};
+
+#define FLOW_NONE SIZE_MAX
+#define FLOW_INFINITE (INT64_MAX / 4)
+
+static void flow_add_edge(struct flow_network *g, int from, int to, int64_t cap) {
+    size_t e = g->edges;
+    g->to[e] = to;
+    g->cap[e] = cap;
+    g->next[e] = g->head[from];
+    g->head[from] = e;
+    g->to[e + 1] = from;
+    g->cap[e + 1] = 0;
+    g->next[e + 1] = g->head[to];
+    g->head[to] = e + 1;
+    g->edges += 2;
+}
+
+/* Labels nodes with their distance from source over edges with capacity left;
+   nodes the source cannot reach have level -1 */
+static void flow_levels(struct flow_network *g, int source) {
+    for (int v = 0; v < g->nodes; v++) {
+        g->level[v] = -1;
+    }
+    int head = 0;
+    int tail = 0;
+    g->level[source] = 0;
+    g->queue[tail++] = source;
+    while (head < tail) {
+        int v = g->queue[head++];
+        for (size_t e = g->head[v]; e != FLOW_NONE; e = g->next[e]) {
+            if (g->cap[e] > 0 && g->level[g->to[e]] < 0) {
+                g->level[g->to[e]] = g->level[v] + 1;
+                g->queue[tail++] = g->to[e];
+            }
+        }
+    }
+}
+
+/* Sends flow along one source to sink path of the level graph, found by a
+   depth-first search that gives up on dead ends for the rest of the phase.
+   Returns the flow sent, or 0 if no path is left. */
+static int64_t flow_augment(struct flow_network *g, int source, int sink) {
+    int depth = 0;
+    int v = source;
+    for (;;) {
+        if (v == sink) {
+            int64_t flow = FLOW_INFINITE;
+            for (int i = 0; i < depth; i++) {
+                flow = g->cap[g->path[i]] < flow ? g->cap[g->path[i]] : flow;
+            }
+            for (int i = 0; i < depth; i++) {
+                g->cap[g->path[i]] -= flow;
+                g->cap[g->path[i] ^ 1] += flow;
+            }
+            return flow;
+        }
+        size_t e = g->cursor[v];
+        while (e != FLOW_NONE && !(g->cap[e] > 0 && g->level[g->to[e]] == g->level[v] + 1)) {
+            e = g->next[e];
+        }
+        g->cursor[v] = e;
+        if (e != FLOW_NONE) {
+            g->path[depth++] = e;
+            v = g->to[e];
+            continue;
+        }
+        g->level[v] = -1;
+        if (depth == 0) {
+            return 0;
+        }
+        e = g->path[--depth];
+        v = g->to[e ^ 1];
+        g->cursor[v] = g->next[e];
+    }
+}
+
+/* Finds the stable matching with the least total of both sides' ranks of their
+   partners, writing each seller's buyer to matches, and returns that total. A
+   stable matching is the seller-optimal one with a closed set of rotations
+   eliminated, so this is a minimum cost closure: a minimum cut of a network with
+   an edge from the source to each rotation that lowers the cost, one to the sink
+   from each that raises it, each of capacity the change, and an uncuttable edge
+   from each rotation to each of its predecessors. The rotations left on the
+   source's side, found by Dinic's algorithm, are the ones to eliminate. */
+int64_t egalitarian_matching(const struct rotation_poset *p, const int *seller_optimal, int *matches) {
+    int count = p->count;
+    size_t npreds = p->pred_offsets[count];
+    struct flow_network g = { .nodes = count + 2 };
+    size_t max_edges = 2 * ((size_t)count + npreds);
+    g.head = alloc_array(g.nodes, sizeof(size_t), "flow network");
+    g.next = alloc_array(max_edges + 1, sizeof(size_t), "flow network");
+    g.to = alloc_array(max_edges + 1, sizeof(int), "flow network");
+    g.cap = alloc_array(max_edges + 1, sizeof(int64_t), "flow network");
+    g.level = alloc_array(g.nodes, sizeof(int), "flow network");
+    g.cursor = alloc_array(g.nodes, sizeof(size_t), "flow network");
+    g.path = alloc_array(g.nodes, sizeof(size_t), "flow network");
+    g.queue = alloc_array(g.nodes, sizeof(int), "flow network");
+    int source = count;
+    int sink = count + 1;
+    for (int v = 0; v < g.nodes; v++) {
+        g.head[v] = FLOW_NONE;
+    }
+    for (int r = 0; r < count; r++) {
+        int64_t delta = p->seller_delta[r] + p->buyer_delta[r];
+        if (delta < 0) {
+            flow_add_edge(&g, source, r, -delta);
+        } else if (delta > 0) {
+            flow_add_edge(&g, r, sink, delta);
+        }
+        for (size_t i = p->pred_offsets[r]; i < p->pred_offsets[r + 1]; i++) {
+            flow_add_edge(&g, r, p->preds[i], FLOW_INFINITE);
+        }
+    }
+    for (;;) {
+        flow_levels(&g, source);
+        if (g.level[sink] < 0) {
+            break;
+        }
+        memcpy(g.cursor, g.head, g.nodes * sizeof(size_t));
+        while (flow_augment(&g, source, sink) > 0) {
+        }
+    }
+
+    /* After the last phase, levels mark what the source still reaches */
+    int64_t cost = p->seller_cost + p->buyer_cost;
+    memcpy(matches, seller_optimal, (size_t)p->n * sizeof(int));
+    for (int r = 0; r < count; r++) {
+        if (g.level[r] >= 0) {
+            rotation_apply(p, r, matches, false);
+            cost += p->seller_delta[r] + p->buyer_delta[r];
+        }
+    }
+    free(g.head);
+    free(g.next);
+    free(g.to);
+    free(g.cap);
+    free(g.level);
+    free(g.cursor);
+    free(g.path);
+    free(g.queue);
+    return cost;
+}
+
+/* Sparse instances. Each side's lists are stored in compressed sparse row form: row
+   i is entries offsets[i] to offsets[i + 1] - 1 of lists, so an instance takes
+   memory in proportion to the total list length rather than to n^2, the sides may
+   differ in size, and a list may rank only part of the other side. In place of a
+   dense rank table, each buyer's row is also kept sorted by seller id with every
+   seller's rank beside it, and looked up by bisection. Entries are always 32 bits;
+   the rows are short enough that narrowing them would save little. */
+
+/* Sets the size of each row of side from counts, making counts its offsets */
+static void sparse_side_alloc(struct sparse_side *side, int n, size_t *counts, const char *what) {
+    side->n = n;
+    side->offsets = counts;
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        size_t count = counts[i];
+        counts[i] = total;
+        total += count;
+    }
+    counts[n] = total;
+    side->lists = alloc_array(total > 0 ? total : 1, sizeof(uint32_t), what);
+}
+
+/* Small open-addressed set of ids, for drawing a row's distinct entries */
+struct id_set {
+    uint32_t *slots;
+    uint32_t mask;
+};
+
+static bool id_set_insert(struct id_set *set, uint32_t id) {
+    uint32_t h = (id * 0x9e3779b1u) & set->mask;
+    while (set->slots[h] != UINT32_MAX) {
+        if (set->slots[h] == id) {
+            return false;
+        }
+        h = (h + 1) & set->mask;
+    }
+    set->slots[h] = id;
+    return true;
+}
+
+struct sparse_generate_job {
+    struct sparse_instance *inst;
+    uint64_t seed;
+    int length;
+};
+
+/* Draws sellers begin..end-1's lists: a uniform random subset of the buyers, by
+   Floyd's algorithm, put in a uniform random order */
+static void sparse_seller_body(void *arg, int begin, int end) {
+    struct sparse_generate_job *job = arg;
+    struct sparse_side *sellers = &job->inst->sellers;
+    uint32_t nbuyers = (uint32_t)job->inst->buyers.n;
+    uint32_t size = 1;
+    while (size < 2 * (uint32_t)job->length) {
+        size *= 2;
+    }
+    struct id_set set = { alloc_array(size, sizeof(uint32_t), "row sampling set"), size - 1 };
+    struct rng rng;
+    for (int s = begin; s < end; s++) {
+        uint32_t *row = sellers->lists + sellers->offsets[s];
+        int length = (int)(sellers->offsets[s + 1] - sellers->offsets[s]);
+        memset(set.slots, 0xff, size * sizeof(uint32_t));
+        rng_seed(&rng, job->seed, SELLER_STREAM(s));
+        int k = 0;
+        for (uint32_t j = nbuyers - (uint32_t)length; j < nbuyers; j++) {
+            uint32_t t = rng_below(&rng, j + 1);
+            if (!id_set_insert(&set, t)) {
+                t = j;  // j itself cannot have been drawn yet
+                id_set_insert(&set, j);
+            }
+            row[k++] = t;
+        }
+        for (int i = length - 1; i > 0; i--) {
+            int j = (int)rng_below(&rng, (uint32_t)i + 1);
+            uint32_t t = row[j];
+            row[j] = row[i];
+            row[i] = t;
+        }
+    }
+    free(set.slots);
+}
+
+/* Ranks buyers begin..end-1's sellers in a uniform random order. On entry the
+   buyer's lookup row holds their sellers sorted by id; each is given a random rank
+   and written to that position of the buyer's list. */
+static void sparse_buyer_body(void *arg, int begin, int end) {
+    struct sparse_generate_job *job = arg;
+    struct sparse_instance *inst = job->inst;
+    struct rng rng;
+    for (int b = begin; b < end; b++) {
+        size_t off = inst->buyers.offsets[b];
+        int length = (int)(inst->buyers.offsets[b + 1] - off);
+        rng_seed(&rng, job->seed, BUYER_STREAM(b));
+        shuffle_array_u32(&rng, inst->buyer_lookup_ranks + off, length);
+        for (int k = 0; k < length; k++) {
+            inst->buyers.lists[off + inst->buyer_lookup_ranks[off + k]] = inst->buyer_lookup_ids[off + k];
+        }
+    }
+}
+
+/* Fills inst with a random sparse instance: each of nsellers sellers ranks length
+   distinct buyers out of nbuyers (all of them, if fewer), and each buyer ranks
+   exactly the sellers who ranked them, so every pair on a list is mutually
+   acceptable. Like generate_random, any split across threads gives the same
+   instance for the seed. */
+void sparse_generate(struct sparse_instance *inst, int nsellers, int nbuyers, int length,
+                     uint64_t seed, int nthreads) {
+    if (length > nbuyers) {
+        length = nbuyers;
+    }
+    size_t *counts = alloc_array((size_t)nsellers + 1, sizeof(size_t), "seller list offsets");
+    for (int s = 0; s < nsellers; s++) {
+        counts[s] = length;
+    }
+    sparse_side_alloc(&inst->sellers, nsellers, counts, "seller lists");
+    inst->buyers.n = nbuyers;
+    struct sparse_generate_job job = { inst, seed, length };
+    parallel_for(nthreads, nsellers, sparse_seller_body, &job);
+
+    /* Every buyer's row is found by a counting sort of the seller rows, which goes
+       through the sellers in order and so leaves each buyer's sellers sorted by id */
+    counts = alloc_array((size_t)nbuyers + 1, sizeof(size_t), "buyer list offsets");
+    memset(counts, 0, ((size_t)nbuyers + 1) * sizeof(size_t));
+    size_t total = inst->sellers.offsets[nsellers];
+    for (size_t k = 0; k < total; k++) {
+        counts[inst->sellers.lists[k]]++;
+    }
+    sparse_side_alloc(&inst->buyers, nbuyers, counts, "buyer lists");
+    inst->buyer_lookup_ids = alloc_array(total > 0 ? total : 1, sizeof(uint32_t), "buyer lookup ids");
+    inst->buyer_lookup_ranks = alloc_array(total > 0 ? total : 1, sizeof(uint32_t), "buyer lookup ranks");
+    mem_charge(MEM_PREFS, ((uint64_t)nsellers + nbuyers + 2) * sizeof(size_t) + 2 * (uint64_t)total * sizeof(uint32_t));
+    mem_charge(MEM_RANK, 2 * (uint64_t)total * sizeof(uint32_t));
+    size_t *fill = alloc_array((size_t)nbuyers, sizeof(size_t), "buyer fill positions");
+    memcpy(fill, inst->buyers.offsets, (size_t)nbuyers * sizeof(size_t));
+    for (int s = 0; s < nsellers; s++) {
+        for (size_t k = inst->sellers.offsets[s]; k < inst->sellers.offsets[s + 1]; k++) {
+            inst->buyer_lookup_ids[fill[inst->sellers.lists[k]]++] = (uint32_t)s;
+        }
+    }
+    free(fill);
+    parallel_for(nthreads, nbuyers, sparse_buyer_body, &job);
+}
+
+void sparse_free(struct sparse_instance *inst) {
+    uint64_t total = inst->sellers.offsets[inst->sellers.n];
+    mem_release(MEM_PREFS, ((uint64_t)inst->sellers.n + inst->buyers.n + 2) * sizeof(size_t)
+                + 2 * total * sizeof(uint32_t));
+    mem_release(MEM_RANK, 2 * total * sizeof(uint32_t));
+    free(inst->sellers.offsets);
+    free(inst->sellers.lists);
+    free(inst->buyers.offsets);
+    free(inst->buyers.lists);
+    free(inst->buyer_lookup_ids);
+    free(inst->buyer_lookup_ranks);
+    memset(inst, 0, sizeof(*inst));
+}
+
+/* Seller s's position on buyer b's list, or -1 if b does not rank s */
+static inline int sparse_rank(const struct sparse_instance *inst, int b, int s) {
+    size_t lo = inst->buyers.offsets[b], hi = inst->buyers.offsets[b + 1];
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (inst->buyer_lookup_ids[mid] < (uint32_t)s) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < inst->buyers.offsets[b + 1] && inst->buyer_lookup_ids[lo] == (uint32_t)s
+           ? (int)inst->buyer_lookup_ranks[lo] : -1;
+}
+
+/* Allocates match state for a sparse instance, with the seller arrays sized for its
+   sellers and the buyer arrays for its buyers, and resets it */
+void sparse_state_alloc(struct match_state *st, const struct sparse_instance *inst) {
+    int nsellers = inst->sellers.n, nbuyers = inst->buyers.n;
+    *st = (struct match_state){
+        .n = nsellers,
+        .seller_next_choices = alloc_array(nsellers, sizeof(int), "seller next choices"),
+        .buyer_final_prefs = alloc_array(nbuyers, sizeof(int), "buyer final ranks"),
+        .seller_matches = alloc_array(nsellers, sizeof(int), "seller matches"),
+        .buyer_matches = alloc_array(nbuyers, sizeof(int), "buyer matches"),
+        .free_sellers = alloc_array(nsellers, sizeof(int), "free seller list"),
+    };
+    mem_charge(MEM_MATCH, match_state_bytes(nsellers, nbuyers));
+    for (int s = 0; s < nsellers; s++) {
+        st->seller_next_choices[s] = 0;
+        st->seller_matches[s] = -1;
+    }
+    for (int b = 0; b < nbuyers; b++) {
+        st->buyer_final_prefs[b] = -1;
+        st->buyer_matches[b] = -1;
+    }
+}
+
+/* Frees a match state from sparse_state_alloc */
+void sparse_state_free(struct match_state *st, const struct sparse_instance *inst) {
+    mem_release(MEM_MATCH, match_state_bytes(inst->sellers.n, inst->buyers.n));
+    free_match_arrays(st);
+}
+
+/* Sellers propose down their lists as in the dense LIFO solver, except that a buyer
+   who does not rank the proposer turns them down, and a seller who reaches the end
+   of their list without being kept stays unmatched. The result is the
+   seller-optimal stable matching, which may leave sellers and buyers unmatched. */
+void sparse_solve(const struct sparse_instance *inst, struct match_state *st) {
+    const struct sparse_side *sellers = &inst->sellers;
+    int top = 0;
+    for (int s = sellers->n - 1; s >= 0; s--) {
+        st->free_sellers[top++] = s;
+    }
+    while (top > 0) {
+        int curr_seller = st->free_sellers[--top];
+        while (curr_seller >= 0) {
+            size_t next = sellers->offsets[curr_seller] + st->seller_next_choices[curr_seller];
+            if (next == sellers->offsets[curr_seller + 1]) {
+                break;  // list exhausted, so this seller stays unmatched
+            }
+            int curr_buyer = (int)sellers->lists[next];
+            st->seller_next_choices[curr_seller]++;
+            STAT_INC(st, proposals);
+            int rank = sparse_rank(inst, curr_buyer, curr_seller);
+            int other_seller = st->buyer_matches[curr_buyer];
+            if (rank < 0 || (other_seller >= 0 && rank > st->buyer_final_prefs[curr_buyer])) {
+                STAT_INC(st, rejections);
+                continue;
+            }
+            st->buyer_final_prefs[curr_buyer] = rank;
+            st->buyer_matches[curr_buyer] = curr_seller;
+            st->seller_matches[curr_seller] = curr_buyer;
+            if (other_seller >= 0) {
+                st->seller_matches[other_seller] = -1;
+                STAT_INC(st, engagements_broken);
+            }
+            curr_seller = other_seller;
+        }
+    }
+}
+
+struct sparse_verify_job {
+    const struct sparse_instance *inst;
+    const struct match_state *st;
+    struct verify_result result;
+};
+
+/* Checks sellers begin..end-1: a matched seller's buyer must rank them and hold
+   them, and no buyer the seller ranks above their partner (or anywhere, if they
+   are unmatched) may rank them above the buyer's own partner, or be free */
+static void sparse_verify_body(void *arg, int begin, int end) {
+    struct sparse_verify_job *job = arg;
+    const struct sparse_instance *inst = job->inst;
+    const struct match_state *st = job->st;
+    for (int s = begin; s < end; s++) {
+        if (atomic_load_explicit(&job->result.failed, memory_order_relaxed)) {
+            return;
+        }
+        int partner = st->seller_matches[s];
+        if (partner >= inst->buyers.n || (partner >= 0 && (st->buyer_matches[partner] != s
+                                                           || sparse_rank(inst, partner, s) < 0))) {
+            verify_fail(&job->result, VERIFY_NOT_PERFECT, s, partner);
+            return;
+        }
+        for (size_t k = inst->sellers.offsets[s];
+             k < inst->sellers.offsets[s + 1] && (int)inst->sellers.lists[k] != partner; k++) {
+            int b = (int)inst->sellers.lists[k];
+            int rank = sparse_rank(inst, b, s);
+            if (rank >= 0 && (st->buyer_matches[b] < 0 || rank < sparse_rank(inst, b, st->buyer_matches[b]))) {
+                verify_fail(&job->result, VERIFY_BLOCKING_PAIR, s, b);
+                return;
+            }
+        }
+    }
+}
+
+/* Checks that st holds a stable matching of the sparse instance: every pair is
+   mutually ranked and each buyer holds at most the one seller matched to them, and
+   no mutually ranked pair would both rather be together. Prints the first problem
+   found and returns false if there is one. */
+bool sparse_verify(const struct sparse_instance *inst, const struct match_state *st, int nthreads) {
+    struct sparse_verify_job job = { .inst = inst, .st = st };
+    atomic_init(&job.result.failed, false);
+    parallel_for(nthreads, inst->sellers.n, sparse_verify_body, &job);
+    for (int b = 0; b < inst->buyers.n && !atomic_load(&job.result.failed); b++) {
+        int s = st->buyer_matches[b];
+        if (s >= 0 && st->seller_matches[s] != b) {
+            verify_fail(&job.result, VERIFY_NOT_HELD_BACK, s, b);
+        }
+    }
+    return report_verify_result(&job.result);
+}
+
+/* Lazy random instances. Only the entries the solve reads are ever produced, so an
+   instance costs O(n) memory and the solve its expected O(n log n) proposals, with
+   nothing generated up front. Seller s's list is a pseudo-random permutation of the
+   buyers, evaluated at one position at a time: a four-round Feistel network over
+   4^half_bits >= n values, keyed by the seller's stream, cycle-walked back into
+   0..n-1. Buyer b ranks sellers by a hash of (b's stream key, s), lowest first,
+   which orders them uniformly at random. These are different instances from the
+   dense generator's for the same seed, drawn from the same distribution. */
+
+/* Sets up the lazy instance of n a side for the seed */
+void lazy_init(struct lazy_instance *inst, int n, uint64_t seed) {
+    inst->n = n;
+    inst->seed = seed;
+    inst->half_bits = 1;
+    while (((uint64_t)1 << (2 * inst->half_bits)) < (uint64_t)n) {
+        inst->half_bits++;
+    }
+}
+
+/* Key of a row's stream: the first word rng_seed would give it */
+static inline uint64_t stream_key(uint64_t seed, uint64_t stream) {
+    uint64_t x = stream;
+    x = seed ^ splitmix64(&x);
+    return splitmix64(&x);
+}
+
+/* Seller s's kth choice of buyer */
+static inline int lazy_choice(const struct lazy_instance *inst, int s, int k) {
+    uint64_t key = stream_key(inst->seed, SELLER_STREAM(s));
+    int h = inst->half_bits;
+    uint32_t mask = ((uint32_t)1 << h) - 1;
+    uint32_t x = (uint32_t)k;
+    do {
+        uint32_t left = x >> h, right = x & mask;
+        for (uint64_t round = 0; round < 4; round++) {
+            uint64_t z = key + round * 0x9E3779B97F4A7C15ull + right;
+            uint32_t next = left ^ ((uint32_t)splitmix64(&z) & mask);
+            left = right;
+            right = next;
+        }
+        x = left << h | right;
+    } while (x >= (uint32_t)inst->n);
+    return (int)x;
+}
+
+/* True if buyer b ranks seller s above seller t */
+static inline bool lazy_prefers(const struct lazy_instance *inst, int b, int s, int t) {
+    uint64_t key = stream_key(inst->seed, BUYER_STREAM(b));
+    uint64_t zs = key ^ (uint64_t)s, zt = key ^ (uint64_t)t;
+    uint64_t score_s = splitmix64(&zs), score_t = splitmix64(&zt);
+    return score_s < score_t || (score_s == score_t && s < t);
+}
+
+/* The LIFO solve on a lazy instance, from the starting state in st. Buyers compare
+   a proposer with their current match by recomputing both hashes, so no rank of
+   any kind is stored; buyer_final_prefs is left at -1. */
+void lazy_solve(const struct lazy_instance *inst, struct match_state *st) {
+    int top = 0;
+    for (int i = inst->n - 1; i >= 0; i--) {
+        st->free_sellers[top++] = i;
+    }
+    while (top > 0) {
+        int curr_seller = st->free_sellers[--top];
+        while (curr_seller >= 0) {
+            int curr_buyer = lazy_choice(inst, curr_seller, st->seller_next_choices[curr_seller]++);
+            STAT_INC(st, proposals);
+            int other_seller = st->buyer_matches[curr_buyer];
+            if (other_seller >= 0 && !lazy_prefers(inst, curr_buyer, curr_seller, other_seller)) {
+                STAT_INC(st, rejections);
+                continue;
+            }
+            st->buyer_matches[curr_buyer] = curr_seller;
+            st->seller_matches[curr_seller] = curr_buyer;
+            if (other_seller >= 0) {
+                st->seller_matches[other_seller] = -1;
+                STAT_INC(st, engagements_broken);
+            }
+            curr_seller = other_seller;
+        }
+    }
+}
+
+struct lazy_verify_job {
+    const struct lazy_instance *inst;
+    const struct match_state *st;
+    struct verify_result result;
+};
+
+/* Same checks as verify_sellers, evaluating lists and rankings as it goes */
+static void lazy_verify_body(void *arg, int begin, int end) {
+    struct lazy_verify_job *job = arg;
+    const struct lazy_instance *inst = job->inst;
+    const struct match_state *st = job->st;
+    for (int s = begin; s < end; s++) {
+        if (atomic_load_explicit(&job->result.failed, memory_order_relaxed)) {
+            return;
+        }
+        int partner = st->seller_matches[s];
+        if (partner < 0 || partner >= inst->n || st->buyer_matches[partner] != s) {
+            verify_fail(&job->result, VERIFY_NOT_PERFECT, s, partner);
+            return;
+        }
+        for (int j = 0; j < inst->n; j++) {
+            int b = lazy_choice(inst, s, j);
+            if (b == partner) {
+                break;
+            }
+            if (lazy_prefers(inst, b, s, st->buyer_matches[b])) {
+                verify_fail(&job->result, VERIFY_BLOCKING_PAIR, s, b);
+                return;
+            }
+        }
+    }
+}
+
+/* Checks that st holds a perfect, stable matching of the lazy instance */
+bool lazy_verify(const struct lazy_instance *inst, const struct match_state *st, int nthreads) {
+    struct lazy_verify_job job = { .inst = inst, .st = st };
+    atomic_init(&job.result.failed, false);
+    parallel_for(nthreads, inst->n, lazy_verify_body, &job);
+    return report_verify_result(&job.result);
+}
+
+/* Distributed solving, in rounds. Each node holds a block of the sellers and the
+   same block of the buyers. In a round, every free seller proposes to their next
+   choice; proposals to the node's own buyers are settled at once, and the rest go
+   out in one batch per node, all in a single exchange. Each node's buyers then
+   weigh what they were sent, and the sellers they turn away or let go go back to
+   their nodes in a second exchange. The rounds end when the free sellers summed
+   over the nodes come to zero, which is exact because every proposal made in a
+   round is answered in it. The result is the seller-optimal matching, the same as
+   a single solve's. */
+
+/* Words of verification queries a node sends per exchange, to bound the buffers */
+#define VERIFY_QUERY_WORDS ((size_t)1 << 21)
+
+/* Node node's block of ids, out of n split over nodes nodes */
+void node_block(int n, int nodes, int node, int *begin, int *end) {
+    int block = (int)(((int64_t)n + nodes - 1) / nodes);
+    *begin = (int64_t)node * block < n ? node * block : n;
+    *end = n - *begin > block ? *begin + block : n;
+}
+
+struct node_job {
+    struct node_instance *inst;
+    uint64_t seed;
+    const struct pref_matrix *buyer_prefs;
+};
+
+static void node_generate_body(void *arg, int begin, int end) {
+    struct node_job *job = arg;
+    DISPATCH(job->inst->width, node_generate_rows, job->inst, job->seed, begin, end);
+}
+
+static void node_rank_body(void *arg, int begin, int end) {
+    struct node_job *job = arg;
+    DISPATCH(job->inst->width, node_rank_rows, job->inst, job->buyer_prefs, begin, end);
+}
+
+static void node_instance_init(struct node_instance *inst, int n, int width, const struct transport *t) {
+    memset(inst, 0, sizeof(*inst));
+    inst->n = n;
+    inst->width = width;
+    node_block(n, t->size, t->rank, &inst->begin, &inst->end);
+}
+
+/* Generates the node's block of the uniformly random instance for the seed, using
+   nthreads threads */
+void node_generate(struct node_instance *inst, int n, int width, uint64_t seed, const struct transport *t,
+                   int nthreads) {
+    node_instance_init(inst, n, width, t);
+    int rows = inst->end - inst->begin;
+    pm_alloc_rows(&inst->seller_prefs, rows, n, width, MEM_PREFS, "seller preference lists");
+    pm_alloc_rows(&inst->buyer_rank, rows, n, width, MEM_RANK, "buyer rank rows");
+    struct node_job job = { inst, seed, NULL };
+    parallel_for(nthreads, rows, node_generate_body, &job);
+}
+
+/* Takes the node's block from a whole instance, typically a loaded file: the
+   sellers' lists are used in place, so only the pages of the block are ever read,
+   and the buyers' rank rows are built from their lists */
+void node_attach(struct node_instance *inst, const struct instance *whole, const struct transport *t,
+                 int nthreads) {
+    node_instance_init(inst, whole->n, whole->width, t);
+    int rows = inst->end - inst->begin;
+    inst->seller_prefs = whole->seller_prefs;
+    inst->seller_prefs.data = (char *)whole->seller_prefs.data + (size_t)inst->begin * whole->n * whole->width;
+    inst->mapped = true;
+    pm_alloc_rows(&inst->buyer_rank, rows, inst->n, inst->width, MEM_RANK, "buyer rank rows");
+    struct node_job job = { inst, 0, &whole->buyer_prefs };
+    parallel_for(nthreads, rows, node_rank_body, &job);
+}
+
+void node_instance_free(struct node_instance *inst) {
+    uint64_t bytes = (uint64_t)(inst->end - inst->begin) * inst->n * inst->width;
+    if (!inst->mapped) {
+        mem_release(MEM_PREFS, bytes);
+        free(inst->seller_prefs.data);
+    }
+    mem_release(MEM_RANK, bytes);
+    free(inst->buyer_rank.data);
+    inst->seller_prefs.data = NULL;
+    inst->buyer_rank.data = NULL;
+}
+
+/* Allocates match state for the node's block, in which n is its number of sellers,
+   and resets it */
+void node_state_alloc(struct match_state *st, const struct node_instance *inst) {
+    int rows = inst->end - inst->begin;
+    *st = (struct match_state){
+        .n = rows,
+        .seller_next_choices = alloc_array(rows, sizeof(int), "seller next choices"),
+        .buyer_final_prefs = alloc_array(rows, sizeof(int), "buyer final ranks"),
+        .seller_matches = alloc_array(rows, sizeof(int), "seller matches"),
+        .buyer_matches = alloc_array(rows, sizeof(int), "buyer matches"),
+        .free_sellers = alloc_array(rows, sizeof(int), "free seller list"),
+    };
+    mem_charge(MEM_MATCH, match_state_bytes(rows, rows));
+    match_state_reset(st);
+}
+
+void node_state_free(struct match_state *st) {
+    mem_release(MEM_MATCH, match_state_bytes(st->n, st->n));
+    free_match_arrays(st);
+}
+
+/* A node's messages for one exchange, bucketed by the node each is for, and what
+   came back. A message is words words long and goes to the node whose block holds
+   its first word, a buyer's or seller's id. */
+struct node_mail {
+    int block;               // ids per node
+    uint32_t *send;
+    size_t send_capacity;    // in words
+    size_t *send_counts;     // words for each node
+    size_t *cursors;
+    uint32_t *recv;
+    size_t recv_capacity;
+    size_t *recv_counts;     // words from each node
+    size_t received;         // messages in recv
+};
+
+static void mail_init(struct node_mail *m, const struct node_instance *inst, const struct transport *t) {
+    *m = (struct node_mail){
+        .block = (int)(((int64_t)inst->n + t->size - 1) / t->size),
+        .send_counts = alloc_array(t->size, sizeof(size_t), "message counts"),
+        .cursors = alloc_array(t->size, sizeof(size_t), "message offsets"),
+        .recv_counts = alloc_array(t->size, sizeof(size_t), "message counts"),
+    };
+}
+
+static void mail_free(struct node_mail *m) {
+    free(m->send);
+    free(m->send_counts);
+    free(m->cursors);
+    free(m->recv);
+    free(m->recv_counts);
+}
+
+/* Sorts the messages queued in out by node with a counting pass, exchanges them
+   and empties out */
+static void mail_exchange(struct node_mail *m, struct transport *t, struct int_list *out, int words) {
+    size_t count = out->count / words;
+    memset(m->send_counts, 0, t->size * sizeof(size_t));
+    for (size_t k = 0; k < count; k++) {
+        m->send_counts[out->items[k * words] / m->block] += words;
+    }
+    if (out->count > m->send_capacity) {
+        free(m->send);
+        m->send_capacity = out->count > 2 * m->send_capacity ? out->count : 2 * m->send_capacity;
+        m->send = alloc_array(m->send_capacity, sizeof(uint32_t), "outgoing messages");
+    }
+    size_t offset = 0;
+    for (int d = 0; d < t->size; d++) {
+        m->cursors[d] = offset;
+        offset += m->send_counts[d];
+    }
+    for (size_t k = 0; k < count; k++) {
+        const int *msg = &out->items[k * words];
+        size_t *at = &m->cursors[msg[0] / m->block];
+        for (int w = 0; w < words; w++) {
+            m->send[(*at)++] = (uint32_t)msg[w];
+        }
+    }
+    t->exchange(t, m->send, m->send_counts, &m->recv, &m->recv_capacity, m->recv_counts);
+    size_t total = 0;
+    for (int src = 0; src < t->size; src++) {
+        total += m->recv_counts[src];
+    }
+    m->received = total / words;
+    out->count = 0;
+}
+
+/* Solves the distributed instance from the starting state in st. Afterwards each
+   seller's match is the buyer they proposed to last, and stats, on every node,
+   covers them all. */
+void distributed_solve(const struct node_instance *inst, struct match_state *st, struct transport *t,
+                       struct distributed_stats *stats) {
+    struct node_mail mail;
+    mail_init(&mail, inst, t);
+    struct int_list proposals = {0}, replies = {0};
+    int top = 0;
+    for (int i = inst->end - inst->begin - 1; i >= 0; i--) {
+        st->free_sellers[top++] = i;
+    }
+    uint64_t rounds = 0, messages = 0;
+    while (t->sum(t, (uint64_t)top) > 0) {
+        rounds++;
+        DISPATCH(inst->width, node_propose, inst, st, &top, &proposals, &replies);
+        messages += proposals.count / 2;
+        mail_exchange(&mail, t, &proposals, 2);
+        DISPATCH(inst->width, node_answer, inst, st, mail.recv, mail.received, &top, &replies);
+        messages += replies.count;
+        mail_exchange(&mail, t, &replies, 1);
+        for (size_t k = 0; k < mail.received; k++) {
+            st->free_sellers[top++] = (int)mail.recv[k] - inst->begin;
+        }
+    }
+    stats->rounds = rounds;
+    stats->proposals = t->sum(t, count_proposals(st));
+    stats->messages = t->sum(t, messages);
+    free(proposals.items);
+    free(replies.items);
+    mail_free(&mail);
+}
+
+/* Checks that the nodes' states make up a perfect, stable matching, with the same
+   checks as verify_sellers: each seller asks their partner whether they are held,
+   and each buyer they rank higher whether that buyer would rather have them. The
+   node that finds a failure reports it; every node returns the overall result. */
+bool distributed_verify(const struct node_instance *inst, const struct match_state *st, struct transport *t) {
+    struct verify_result v;
+    atomic_init(&v.failed, false);
+    struct node_mail mail;
+    mail_init(&mail, inst, t);
+    struct int_list queries = {0};
+    int cursor = 0, count = inst->end - inst->begin;
+    while (t->sum(t, (uint64_t)(count - cursor)) > 0) {
+        DISPATCH(inst->width, node_verify_queries, inst, st, &cursor, VERIFY_QUERY_WORDS, &queries, &v);
+        mail_exchange(&mail, t, &queries, 2);
+        DISPATCH(inst->width, node_verify_answer, inst, st, mail.recv, mail.received, &v);
+    }
+    bool failed = !report_verify_result(&v);
+    free(queries.items);
+    mail_free(&mail);
+    return t->sum(t, failed) == 0;
+}
+
+/* Collects every node's seller matches on node 0, in order of seller */
+void distributed_gather(const struct node_instance *inst, const struct match_state *st, struct transport *t,
+                        int *matches) {
+    int count = inst->end - inst->begin;
+    size_t *send_counts = alloc_array(t->size, sizeof(size_t), "message counts");
+    size_t *recv_counts = alloc_array(t->size, sizeof(size_t), "message counts");
+    uint32_t *send = alloc_array(count, sizeof(uint32_t), "outgoing matches");
+    memset(send_counts, 0, t->size * sizeof(size_t));
+    send_counts[0] = count;
+    for (int i = 0; i < count; i++) {
+        send[i] = (uint32_t)st->seller_matches[i];
+    }
+    uint32_t *recv = NULL;
+    size_t capacity = 0;
+    t->exchange(t, send, send_counts, &recv, &capacity, recv_counts);
+    if (t->rank == 0) {
+        for (int s = 0; s < inst->n; s++) {
+            matches[s] = (int)recv[s];
+        }
+    }
+    free(recv);
+    free(send);
+    free(recv_counts);
+    free(send_counts);
+}
+
+/* Makes room for count words in a transport's receive buffer */
+static void reserve_words(uint32_t **buf, size_t *capacity, size_t count) {
+    if (count > *capacity) {
+        free(*buf);
+        *capacity = count > 2 * *capacity ? count : 2 * *capacity;
+        *buf = alloc_array(*capacity, sizeof(uint32_t), "incoming messages");
+    }
+}
+
+/* The threads transport: nodes are threads of this process, which post pointers to
+   their outgoing buffers and copy what is theirs straight out of everyone else's,
+   between barriers */
+struct thread_nodes {
+    int size;
+    pthread_barrier_t barrier;
+    const uint32_t **send;
+    const size_t **send_counts;
+    uint64_t *values;
+    void (*node_main)(struct transport *t, void *arg);
+    void *arg;
+};
+
+static void thread_exchange(struct transport *t, const uint32_t *send, const size_t *send_counts, uint32_t **recv,
+                            size_t *recv_capacity, size_t *recv_counts) {
+    struct thread_nodes *nodes = t->impl;
+    nodes->send[t->rank] = send;
+    nodes->send_counts[t->rank] = send_counts;
+    pthread_barrier_wait(&nodes->barrier);
+    size_t total = 0;
+    for (int src = 0; src < nodes->size; src++) {
+        recv_counts[src] = nodes->send_counts[src][t->rank];
+        total += recv_counts[src];
+    }
+    reserve_words(recv, recv_capacity, total);
+    size_t at = 0;
+    for (int src = 0; src < nodes->size; src++) {
+        size_t offset = 0;
+        for (int d = 0; d < t->rank; d++) {
+            offset += nodes->send_counts[src][d];
+        }
+        memcpy(*recv + at, nodes->send[src] + offset, recv_counts[src] * sizeof(uint32_t));
+        at += recv_counts[src];
+    }
+    // Nobody may reuse their buffers until everyone has copied out of them
+    pthread_barrier_wait(&nodes->barrier);
+}
+
+static uint64_t thread_sum(struct transport *t, uint64_t value) {
+    struct thread_nodes *nodes = t->impl;
+    nodes->values[t->rank] = value;
+    pthread_barrier_wait(&nodes->barrier);
+    uint64_t total = 0;
+    for (int r = 0; r < nodes->size; r++) {
+        total += nodes->values[r];
+    }
+    pthread_barrier_wait(&nodes->barrier);
+    return total;
+}
+
+static void *thread_node_main(void *arg) {
+    struct transport *t = arg;
+    struct thread_nodes *nodes = t->impl;
+    nodes->node_main(t, nodes->arg);
+    return NULL;
+}
+
+/* Node 0 runs on the calling thread. A barrier needs every node, so unlike
+   parallel_for this cannot carry on with fewer threads than asked for. */
+void run_thread_nodes(int nodes, void (*node_main)(struct transport *t, void *arg), void *arg) {
+    struct thread_nodes shared = {
+        .size = nodes,
+        .send = alloc_array(nodes, sizeof(uint32_t *), "node buffers"),
+        .send_counts = alloc_array(nodes, sizeof(size_t *), "node buffers"),
+        .values = alloc_array(nodes, sizeof(uint64_t), "node sums"),
+        .node_main = node_main,
+        .arg = arg,
+    };
+    pthread_barrier_init(&shared.barrier, NULL, nodes);
+    struct transport *transports = alloc_array(nodes, sizeof(struct transport), "node transports");
+    pthread_t *threads = alloc_array(nodes, sizeof(pthread_t), "thread handles");
+    for (int r = 0; r < nodes; r++) {
+        transports[r] = (struct transport){ r, nodes, &shared, thread_exchange, thread_sum };
+    }
+    for (int r = 1; r < nodes; r++) {
+        if (pthread_create(&threads[r], NULL, thread_node_main, &transports[r]) != 0) {
+            fprintf(stderr, "Cannot start a thread for node %d of %d\n", r, nodes);
+            exit(1);
+        }
+    }
+    thread_node_main(&transports[0]);
+    for (int r = 1; r < nodes; r++) {
+        pthread_join(threads[r], NULL);
+    }
+    pthread_barrier_destroy(&shared.barrier);
+    free(threads);
+    free(transports);
+    free(shared.values);
+    free(shared.send_counts);
+    free(shared.send);
+}
+
+#ifdef SM_MPI
+/* The MPI transport: an exchange is MPI_Alltoall of the counts, then MPI_Alltoallv
+   of the words, and a sum is MPI_Allreduce, all over MPI_COMM_WORLD */
+struct mpi_nodes {
+    int *send_counts;
+    int *send_offsets;
+    int *recv_counts;
+    int *recv_offsets;
+};
+
+static void mpi_exchange(struct transport *t, const uint32_t *send, const size_t *send_counts, uint32_t **recv,
+                         size_t *recv_capacity, size_t *recv_counts) {
+    struct mpi_nodes *m = t->impl;
+    int offset = 0;
+    for (int d = 0; d < t->size; d++) {
+        if (send_counts[d] > (size_t)(INT_MAX - offset)) {
+            fprintf(stderr, "Node %d has more than %d words to send in one exchange\n", t->rank, INT_MAX);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        m->send_counts[d] = (int)send_counts[d];
+        m->send_offsets[d] = offset;
+        offset += m->send_counts[d];
+    }
+    MPI_Alltoall(m->send_counts, 1, MPI_INT, m->recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+    size_t total = 0;
+    for (int src = 0; src < t->size; src++) {
+        if (total > (size_t)INT_MAX - m->recv_counts[src]) {
+            fprintf(stderr, "Node %d has more than %d words to receive in one exchange\n", t->rank, INT_MAX);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        m->recv_offsets[src] = (int)total;
+        recv_counts[src] = (size_t)m->recv_counts[src];
+        total += recv_counts[src];
+    }
+    reserve_words(recv, recv_capacity, total);
+    MPI_Alltoallv(send, m->send_counts, m->send_offsets, MPI_UINT32_T, *recv, m->recv_counts, m->recv_offsets,
+                  MPI_UINT32_T, MPI_COMM_WORLD);
+}
+
+static uint64_t mpi_sum(struct transport *t, uint64_t value) {
+    (void)t;
+    uint64_t total;
+    MPI_Allreduce(&value, &total, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    return total;
+}
+
+void mpi_transport_init(struct transport *t, int *argc, char ***argv) {
+    MPI_Init(argc, argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &t->rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &t->size);
+    struct mpi_nodes *m = alloc_array(1, sizeof(*m), "MPI transport");
+    m->send_counts = alloc_array(t->size, sizeof(int), "message counts");
+    m->send_offsets = alloc_array(t->size, sizeof(int), "message offsets");
+    m->recv_counts = alloc_array(t->size, sizeof(int), "message counts");
+    m->recv_offsets = alloc_array(t->size, sizeof(int), "message offsets");
+    t->impl = m;
+    t->exchange = mpi_exchange;
+    t->sum = mpi_sum;
+}
+
+void mpi_transport_finish(struct transport *t) {
+    struct mpi_nodes *m = t->impl;
+    free(m->send_counts);
+    free(m->send_offsets);
+    free(m->recv_counts);
+    free(m->recv_offsets);
+    free(m);
+    MPI_Finalize();
+}
+#endif
+
+/* The embedding API. A context's matrices and arrays are sized for capacity, and an
+   instance of any n up to it uses the first n x n entries of each matrix and the
+   first n of each array, so one context serves every smaller size too. */
+
+/* Sizes ctx for instances of up to capacity a side, with entries width bytes wide
+   (0 for the narrowest that fits capacity). Without rank_table the context only
+   supports the scan solver and cannot verify, but needs a third less memory. */
+int sm_init(struct sm_context *ctx, int capacity, int width, bool rank_table) {
+    memset(ctx, 0, sizeof(*ctx));
+    if (capacity < 1 || (width != 0 && width != 2 && width != 4)
+        || (width != 0 && width < index_width_for(capacity))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (width == 0) {
+        width = index_width_for(capacity);
+    }
+    size_t matrix = arena_bytes((size_t)capacity * capacity, width);
+    size_t array = arena_bytes(capacity, sizeof(int));
+    size_t bitset = arena_bytes(((size_t)capacity + 63) / 64, sizeof(uint64_t));
+    size_t holders = rank_table ? arena_bytes(capacity, sizeof(uint64_t)) : 0;
+    if (!arena_init(&ctx->arena, (rank_table ? 3 : 2) * matrix + 5 * array + bitset + holders)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ctx->capacity = capacity;
+    ctx->inst.n = capacity;
+    ctx->inst.width = width;
+    struct pref_matrix *matrices[3] = { &ctx->inst.seller_prefs, &ctx->inst.buyer_prefs, &ctx->inst.buyer_rank };
+    for (int m = 0; m < (rank_table ? 3 : 2); m++) {
+        matrices[m]->n = capacity;
+        matrices[m]->width = width;
+        matrices[m]->data = arena_alloc(&ctx->arena, (size_t)capacity * capacity, width);
+    }
+    ctx->st = (struct match_state){
+        .n = capacity,
+        .seller_next_choices = arena_alloc(&ctx->arena, capacity, sizeof(int)),
+        .buyer_final_prefs = arena_alloc(&ctx->arena, capacity, sizeof(int)),
+        .seller_matches = arena_alloc(&ctx->arena, capacity, sizeof(int)),
+        .buyer_matches = arena_alloc(&ctx->arena, capacity, sizeof(int)),
+        .free_sellers = arena_alloc(&ctx->arena, capacity, sizeof(int)),
+    };
+    ctx->seen = arena_alloc(&ctx->arena, ((size_t)capacity + 63) / 64, sizeof(uint64_t));
+    if (rank_table) {
+        ctx->holders = arena_alloc(&ctx->arena, capacity, sizeof(uint64_t));
+    }
+    mem_charge(MEM_PREFS, 2 * matrix);
+    mem_charge(MEM_RANK, rank_table ? matrix : 0);
+    mem_charge(MEM_MATCH, 5 * array);
+    mem_charge(MEM_OTHER, bitset + holders);
+    return 0;
+}
+
+/* Replaces the context's instance with a random one of n a side, the same one
+   generate_random makes for the seed */
+int sm_generate(struct sm_context *ctx, int n, uint64_t seed, int nthreads) {
+    return sm_generate_with(ctx, find_generator("uniform"), n, seed, nthreads);
+}
+
+/* Replaces the current instance with one of size n drawn from gen */
+int sm_generate_with(struct sm_context *ctx, const struct instance_generator *gen, int n, uint64_t seed,
+                     int nthreads) {
+    if (n < 1 || n > ctx->capacity) {
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->inst.n = ctx->st.n = n;
+    ctx->inst.seller_prefs.n = ctx->inst.buyer_prefs.n = ctx->inst.buyer_rank.n = n;
+    ctx->rank_ready = false;
+    void *shared = gen->prepare != NULL ? gen->prepare(&ctx->inst, seed) : NULL;
+    struct generator_job job = { gen, &ctx->inst, seed, shared };
+    int result = parallel_for_in(ctx, nthreads, n, generator_body, &job);
+    free(shared);
+    return result;
+}
+
+/* Replaces the current instance with a copy of the given lists: each side's n rows
+   of n entries, row-major, width (2 or 4) bytes apiece. Fails with EINVAL if n is
+   over the capacity or a row is not a permutation of 0..n-1. */
+int sm_load_lists(struct sm_context *ctx, int n, int width, const void *seller_lists, const void *buyer_lists) {
+    if (n < 1 || n > ctx->capacity || (width != 2 && width != 4)) {
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->inst.n = ctx->st.n = n;
+    ctx->inst.seller_prefs.n = ctx->inst.buyer_prefs.n = ctx->inst.buyer_rank.n = n;
+    ctx->rank_ready = false;
+    bool valid = DISPATCH(ctx->inst.width, copy_rows, &ctx->inst.seller_prefs, seller_lists, width, ctx->seen) < 0
+                 && DISPATCH(ctx->inst.width, copy_rows, &ctx->inst.buyer_prefs, buyer_lists, width, ctx->seen) < 0;
+    if (!valid) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Builds the rank table for the current instance. sm_solve and sm_verify do this
+   themselves when they need it; calling it first only lets it be timed apart. */
+int sm_build_rank_table(struct sm_context *ctx, int nthreads) {
+    if (ctx->inst.buyer_rank.data == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct rank_job job = { &ctx->inst.buyer_prefs, &ctx->inst.buyer_rank };
+    if (parallel_for_in(ctx, nthreads, ctx->inst.n, rank_body, &job) != 0) {
+        return -1;
+    }
+    ctx->rank_ready = true;
+    return 0;
+}
+
+/* Solves the current instance from scratch into ctx->st */
+int sm_solve(struct sm_context *ctx, enum solver_mode mode, enum schedule schedule, int nthreads) {
+    if (needs_rank_table(mode) && !ctx->rank_ready && sm_build_rank_table(ctx, nthreads) != 0) {
+        return -1;
+    }
+    match_state_reset(&ctx->st);
+    if (mode == SOLVER_PARALLEL) {
+        /* The concurrent solve's holders live in the context, rather than being
+           allocated by solve_parallel for each call */
+        holders_reset(ctx->holders, ctx->inst.n);
+        struct concurrent_job job = { &ctx->inst, &ctx->st, ctx->holders };
+        if (parallel_for_in(ctx, nthreads, ctx->inst.n, concurrent_body, &job) != 0) {
+            return -1;
+        }
+        holders_unpack(ctx->holders, &ctx->st, ctx->inst.n);
+        return 0;
+    }
+    run_solver(&ctx->inst, mode, schedule, nthreads, &ctx->st);
+    return 0;
+}
+
+/* Checks the matching in ctx->st. Returns 1 if it is perfect and stable, 0 if not
+   (printing the first problem found to stderr), or -1 if ctx has no rank table. */
+int sm_verify(struct sm_context *ctx, int nthreads) {
+    if (!ctx->rank_ready && sm_build_rank_table(ctx, nthreads) != 0) {
+        return -1;
+    }
+    struct verify_job job = { .inst = &ctx->inst, .st = &ctx->st };
+    atomic_init(&job.result.failed, false);
+    if (parallel_for_in(ctx, nthreads, ctx->inst.n, verify_body, &job) != 0) {
+        return -1;
+    }
+    return report_verify_result(&job.result) ? 1 : 0;
+}
+
+void sm_free(struct sm_context *ctx) {
+    if (ctx->arena.base == NULL) {
+        return;
+    }
+    size_t matrix = arena_bytes((size_t)ctx->capacity * ctx->capacity, ctx->inst.width);
+    mem_release(MEM_PREFS, 2 * matrix);
+    mem_release(MEM_RANK, ctx->inst.buyer_rank.data != NULL ? matrix : 0);
+    mem_release(MEM_MATCH, 5 * arena_bytes(ctx->capacity, sizeof(int)));
+    mem_release(MEM_OTHER, arena_bytes(((size_t)ctx->capacity + 63) / 64, sizeof(uint64_t))
+                           + (ctx->holders != NULL ? arena_bytes(ctx->capacity, sizeof(uint64_t)) : 0));
+    arena_free(&ctx->arena);
+    free(ctx->threads);
+    ctx->threads = NULL;
+    ctx->thread_capacity = 0;
+}
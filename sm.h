@@ -0,0 +1,367 @@
+/* Stable marriage solver library. Holds instances of n sellers and n buyers, each
+   side ranking all of the other in a preference list, and finds stable matchings
+   of them by Gale-Shapley with sellers proposing. The sm command is a thin command
+   line front end to it.
+
+   struct sm_context is the interface meant for embedding: a caller sizes one for
+   the largest instance it expects, then generates, solves and verifies instance
+   after instance in it without further allocation. The lower-level functions
+   below work on instances and match states the caller allocates. */
+
+#ifndef SM_H
+#define SM_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* How a buyer's opinion of a proposing seller is looked up during the solve */
+enum solver_mode {
+    SOLVER_SCAN,     // search the buyer's preference list for the seller, O(n) per proposal
+    SOLVER_RANK,     // look the seller up in a precomputed inverse rank table, O(1) per proposal
+    SOLVER_PARALLEL,  // rank table lookups, with free sellers proposing concurrently on all threads
+    SOLVER_PIPELINED  // rank table lookups, batched so that each batch's cache misses overlap
+};
+
+/* Order in which free sellers get to propose */
+enum schedule {
+    SCHEDULE_ROUND_ROBIN,  // sweep over all n sellers, skipping matched ones
+    SCHEDULE_LIFO,         // pop the most recently freed seller from a stack
+    SCHEDULE_FIFO          // take the longest-waiting seller from a queue
+};
+
+/* What tracked memory is spent on */
+enum mem_category {
+    MEM_PREFS,    // preference lists
+    MEM_RANK,     // rank tables, or a sparse instance's sorted rank lookups
+    MEM_MATCH,    // match states: matches, next choices and free lists
+    MEM_OTHER,    // everything else tracked, such as the buyer heaps
+    MEM_CATEGORIES
+};
+
+/* Bytes currently charged and the most ever charged at once, per category; the
+   peak total is the high-water mark of the sum, not the sum of the peaks */
+struct mem_usage {
+    uint64_t current[MEM_CATEGORIES];
+    uint64_t peak[MEM_CATEGORIES];
+    uint64_t current_total;
+    uint64_t peak_total;
+};
+
+/* An n x n matrix of ids or ranks, e.g. every seller's preference list. Stored
+   row-major in one contiguous aligned allocation so that n is bounded by memory
+   rather than by the stack size. Entries are width bytes wide: 2 (uint16_t) when
+   every id and rank fits, otherwise 4 (uint32_t). */
+struct pref_matrix {
+    int n;
+    int width;
+    void *data;
+};
+
+/* A problem instance: both sides' preference lists, plus the buyers' inverse rank
+   table when the solver uses one (otherwise its data is NULL). The preference lists
+   are either heap allocated or point into a read-only mapping of an instance file. */
+struct instance {
+    int n;
+    int width;
+    struct pref_matrix seller_prefs;  // ith row is ith seller's preference list
+    struct pref_matrix buyer_prefs;
+    struct pref_matrix buyer_rank;    // row b, entry s is seller s's position on buyer b's list
+    struct pref_matrix seller_rank;   // row s, entry b is buyer b's position on seller s's list
+    void *mapping;                    // instance file the lists live in, if loaded
+    size_t mapping_size;
+    uint64_t checksum;                // of the lists, once saved to or loaded from a file
+};
+
+/* Counters kept by the proposal loop when built with -DSM_STATS. Otherwise they stay
+   zero and the STAT_INC calls in the solver compile to nothing. */
+struct solve_counters {
+    uint64_t proposals;
+    uint64_t rejections;          // proposals turned down by an already-matched buyer
+    uint64_t engagements_broken;  // matched sellers displaced by a better proposal
+    uint64_t rounds;              // sweeps over all sellers, round-robin schedule only
+};
+
+/* Per-participant state of one run of the algorithm */
+struct match_state {
+    int n;
+    int *seller_next_choices;  // ith entry is ith seller's next choice of buyer
+    int *buyer_final_prefs;    // for verification - ith entry is the ith buyer's ranking
+    int *seller_matches;       // ith entry is ith seller's matched buyer
+    int *buyer_matches;
+    int *free_sellers;         // stack or queue of unmatched sellers, for those schedules
+    struct solve_counters counters;
+};
+
+/* A bump allocator over a single aligned block. A solver context carves every
+   matrix and array of a solve out of one arena, sized up front for its capacity, so
+   repeated solves reuse the same memory instead of allocating each time. */
+struct arena {
+    char *base;
+    size_t size;
+    size_t used;
+};
+
+/* Many-to-one matching, where buyer b can hold up to capacities[b] sellers. Each
+   buyer's holders are a max-heap of (rank << 32 | seller) keys in entries
+   offsets[b] to offsets[b] + capacities[b] - 1, so the weakest holder, the one a
+   new proposer must beat once the buyer is full, is always at the root. */
+struct buyer_heaps {
+    int n;
+    const int *capacities;  // each at least 1
+    size_t *offsets;        // n + 1 entries
+    int *sizes;             // holders each buyer has now
+    uint64_t *entries;
+};
+
+/* One side of a sparse instance, in compressed sparse row form: row i, which may
+   be of any length, is lists[offsets[i]] to lists[offsets[i + 1] - 1] */
+struct sparse_side {
+    int n;
+    size_t *offsets;   // n + 1 entries
+    uint32_t *lists;   // ids on the other side, in preference order
+};
+
+/* An instance with truncated lists and possibly unequal sides, in memory
+   proportional to the total list length. Buyers' ranks of sellers are looked up
+   in a copy of each buyer's row sorted by seller id, instead of a rank table. */
+struct sparse_instance {
+    struct sparse_side sellers;
+    struct sparse_side buyers;
+    uint32_t *buyer_lookup_ids;    // laid out like buyers.lists, each row sorted by seller id
+    uint32_t *buyer_lookup_ranks;  // position of that seller on the buyer's list
+};
+
+/* A random instance whose lists are computed on demand rather than stored */
+struct lazy_instance {
+    int n;
+    uint64_t seed;
+    int half_bits;  // the sellers' permutations are over 4^half_bits >= n values
+};
+
+/* A way of generating complete instances, for exercising the solvers on different
+   workloads. prepare, if set, builds whatever the rows share (master lists, scores)
+   once per instance and returns it in one allocation, which is freed afterwards.
+   rows fills rows begin..end-1 of both sides' lists; it is called concurrently for
+   disjoint ranges and should depend only on the seed, the row and the shared state,
+   so the instance is the same for any number of threads. find_generator returns
+   the built-in ones by name: uniform, identical, master, popularity, adversarial and
+   correlated. */
+struct instance_generator {
+    const char *name;
+    void *(*prepare)(const struct instance *inst, uint64_t seed);
+    void (*rows)(struct instance *inst, uint64_t seed, const void *shared, int begin, int end);
+};
+
+/* The rotations of an instance and how they must be ordered, from which all of its
+   stable matchings follow. Eliminating rotation r moves each of its sellers on from
+   their buyer to the next seller's. Starting from the seller-optimal matching,
+   eliminating a set of rotations that includes every predecessor of each of its
+   members, in index order, gives a stable matching; every set gives a different
+   one, and every stable matching arises so. Rotation r is pairs offsets[r] to
+   offsets[r + 1] - 1, each a seller and the buyer they hold before it; the last
+   pair's seller moves to the first pair's buyer. Rotations are numbered so that
+   predecessors come first. Costs are sums of ranks, 0 for a first choice. */
+struct rotation_poset {
+    int n;
+    int count;
+    size_t *offsets;
+    int *sellers;
+    int *buyers;
+    int64_t *seller_delta;   // change eliminating rotation r makes to the sellers' cost
+    int64_t *buyer_delta;
+    size_t *pred_offsets;    // rotation r's predecessors are preds[pred_offsets[r]] onwards
+    int *preds;
+    int64_t seller_cost;     // of the seller-optimal matching
+    int64_t buyer_cost;
+};
+
+/* How the nodes of a distributed solve reach each other. Every node has a
+   transport of its own, and every node makes the same calls in the same order,
+   each returning once all of them have made it. exchange is all-to-all: the node
+   sends send_counts[d] words to node d, laid out in send in order of d, and gets
+   back what every node sent it in *recv, grown as needed to *recv_capacity words,
+   in order of sender, recv_counts[src] words from each. sum returns value summed
+   over all the nodes. */
+struct transport {
+    int rank;  // this node, 0 to size - 1
+    int size;  // number of nodes
+    void *impl;
+    void (*exchange)(struct transport *t, const uint32_t *send, const size_t *send_counts, uint32_t **recv,
+                     size_t *recv_capacity, size_t *recv_counts);
+    uint64_t (*sum)(struct transport *t, uint64_t value);
+};
+
+/* One node's share of a distributed instance of n a side. Sellers and buyers are
+   each cut into as many contiguous blocks as there are nodes, and the node holds
+   the same block, begin to end - 1, of both: its sellers' preference lists and its
+   buyers' rank rows, and nobody else's. */
+struct node_instance {
+    int n;
+    int width;
+    int begin;
+    int end;
+    struct pref_matrix seller_prefs;  // row i is seller begin + i's list
+    struct pref_matrix buyer_rank;    // row i, entry s, is seller s's position on buyer begin + i's list
+    bool mapped;                      // seller_prefs points into a loaded instance instead of its own memory
+};
+
+/* What a distributed solve did, summed over the nodes */
+struct distributed_stats {
+    uint64_t rounds;     // proposal and reply exchanges
+    uint64_t proposals;
+    uint64_t messages;   // proposals and replies that went from one node to another
+};
+
+/* A solver context: buffers for instances of up to capacity a side, carved out of
+   one arena by sm_init. inst and st describe the current instance and, after
+   sm_solve, its matching: st.seller_matches[s] is seller s's buyer and
+   st.buyer_matches[b] buyer b's seller. */
+struct sm_context {
+    int capacity;
+    struct arena arena;
+    struct instance inst;
+    struct match_state st;
+    bool rank_ready;  // inst.buyer_rank is up to date with the current lists
+    uint64_t *seen;   // bitset over capacity ids, for checking loaded lists are permutations
+    _Atomic uint64_t *holders;  // each buyer's holder in the parallel solver, with a rank table
+    pthread_t *threads;         // handles for thread_capacity worker threads, grown on demand
+    int thread_capacity;
+};
+
+/* Embedding API. Functions returning int return 0 on success and -1 with errno set
+   on bad arguments (EINVAL) or when memory or threads run out (ENOMEM), rather
+   than exiting; the one exception is a generator's prepare, which for the built-in
+   generators exits if it cannot allocate what the rows share. After a failure the
+   context's instance or matching may be half written. */
+int sm_init(struct sm_context *ctx, int capacity, int width, bool rank_table);
+int sm_generate(struct sm_context *ctx, int n, uint64_t seed, int nthreads);
+int sm_generate_with(struct sm_context *ctx, const struct instance_generator *gen, int n, uint64_t seed,
+                     int nthreads);
+int sm_load_lists(struct sm_context *ctx, int n, int width, const void *seller_lists, const void *buyer_lists);
+int sm_build_rank_table(struct sm_context *ctx, int nthreads);
+int sm_solve(struct sm_context *ctx, enum solver_mode mode, enum schedule schedule, int nthreads);
+int sm_verify(struct sm_context *ctx, int nthreads);
+void sm_free(struct sm_context *ctx);
+
+/* Allocation. These print what was being allocated and exit if memory runs out. */
+int index_width_for(int n);
+void *alloc_array(size_t count, size_t size, const char *what);
+void pm_alloc(struct pref_matrix *m, int n, int width, enum mem_category c, const char *what);
+void pm_free(struct pref_matrix *m, enum mem_category c);
+
+/* Memory accounting, and the bytes each representation will charge */
+void mem_usage_get(struct mem_usage *u);
+uint64_t dense_footprint(int n, int width, int rank_tables, int match_states);
+uint64_t sparse_footprint(int nsellers, int nbuyers, int length);
+uint64_t lazy_footprint(int n);
+uint64_t buyer_heaps_footprint(int n, uint64_t total_capacity);
+uint64_t node_footprint(int n, int width, int nodes);
+
+/* Instances, and the binary and text instance files */
+void instance_alloc(struct instance *inst, int n, int width);
+void instance_free(struct instance *inst);
+void instance_mirror(const struct instance *inst, struct instance *view);
+uint64_t instance_save(const struct instance *inst, const char *path);
+void instance_load(struct instance *inst, const char *path, bool verify_checksum);
+void instance_load_text(struct instance *inst, const char *path, int width);
+void generate_random(struct instance *inst, uint64_t seed, int nthreads);
+const struct instance_generator *find_generator(const char *name);
+void generate_with(struct instance *inst, const struct instance_generator *gen, uint64_t seed, int nthreads);
+void perturb_rows(struct instance *inst, uint64_t seed, int k, int *sellers, int *nsellers,
+                  int *buyers, int *nbuyers);
+void build_rank_table(struct instance *inst, int nthreads);
+void build_seller_rank_table(struct instance *inst, int nthreads);
+
+/* Solving and checking */
+void match_state_alloc(struct match_state *st, int n);
+void match_state_free(struct match_state *st);
+void match_state_reset(struct match_state *st);
+bool needs_rank_table(enum solver_mode mode);
+void run_solver(const struct instance *inst, enum solver_mode mode, enum schedule schedule,
+                int nthreads, struct match_state *st);
+void solve_parallel(const struct instance *inst, struct match_state *st, int nthreads);
+uint64_t resolve_changed(struct instance *inst, struct match_state *st, const int *sellers, int nsellers,
+                         const int *buyers, int nbuyers);
+bool verify_matching(const struct instance *inst, const struct match_state *st, int nthreads);
+
+/* Checkpointed solving. The LIFO rank solve hands a copy of its state to a
+   background writer every interval, which saves it to a snapshot file; a later run
+   on the same instance file resumes from the snapshot where the copy was taken. */
+struct checkpointer;
+struct checkpointer *checkpoint_start(const char *path, int n, uint64_t interval_ns, uint64_t instance_checksum,
+                                      uint64_t seed);
+uint64_t checkpoint_stop(struct checkpointer *ck);
+int snapshot_load(struct match_state *st, const char *path, uint64_t instance_checksum);
+void solve_checkpointed(const struct instance *inst, struct match_state *st, int top, struct checkpointer *ck);
+
+/* Stable matching lattices. seller_optimal and buyer_optimal give each seller's
+   buyer in the two extreme stable matchings. stable_matchings calls visit on up to
+   limit stable matchings (all of them if limit is 0), starting with the
+   seller-optimal one, until visit returns false, and returns how many it visited;
+   *exhausted is set if those were all there are. */
+void rotation_poset_build(struct rotation_poset *p, const struct instance *inst, const int *seller_optimal,
+                          const int *buyer_optimal);
+void rotation_poset_free(struct rotation_poset *p);
+uint64_t stable_matchings(const struct rotation_poset *p, const int *seller_optimal, uint64_t limit,
+                          bool (*visit)(void *arg, const int *matches, int64_t seller_cost, int64_t buyer_cost),
+                          void *arg, bool *exhausted);
+int64_t egalitarian_matching(const struct rotation_poset *p, const int *seller_optimal, int *matches);
+
+/* Many-to-one solving. In the match state, buyer_matches[b] and buyer_final_prefs[b]
+   are buyer b's weakest holder and their rank, or -1 if b holds nobody. */
+void buyer_heaps_alloc(struct buyer_heaps *heaps, int n, const int *capacities);
+void buyer_heaps_free(struct buyer_heaps *heaps);
+void solve_capacitated(const struct instance *inst, struct match_state *st, struct buyer_heaps *heaps);
+bool verify_capacitated(const struct instance *inst, const struct match_state *st,
+                        const struct buyer_heaps *heaps, int nthreads);
+uint64_t count_proposals(const struct match_state *st);
+int64_t sum_ints(const int *a, int n);
+
+/* Sparse instances. Their match state's seller arrays have an entry per seller and
+   buyer arrays an entry per buyer; an unmatched participant's match is -1. */
+void sparse_generate(struct sparse_instance *inst, int nsellers, int nbuyers, int length,
+                     uint64_t seed, int nthreads);
+void sparse_free(struct sparse_instance *inst);
+void sparse_state_alloc(struct match_state *st, const struct sparse_instance *inst);
+void sparse_state_free(struct match_state *st, const struct sparse_instance *inst);
+void sparse_solve(const struct sparse_instance *inst, struct match_state *st);
+bool sparse_verify(const struct sparse_instance *inst, const struct match_state *st, int nthreads);
+
+/* Lazy random instances, solved with a match state for n a side */
+void lazy_init(struct lazy_instance *inst, int n, uint64_t seed);
+void lazy_solve(const struct lazy_instance *inst, struct match_state *st);
+bool lazy_verify(const struct lazy_instance *inst, const struct match_state *st, int nthreads);
+
+/* Distributed solving. Each node's match state has an entry per seller and buyer
+   of its block, seller begin + i's at index i; seller_matches holds buyer ids and
+   buyer_matches seller ids, as usual. Every node calls each of these with the
+   others, apart from node_block and the frees. distributed_gather leaves every
+   seller's buyer in matches on node 0, and its arguments are ignored elsewhere.
+   run_thread_nodes runs node_main on a thread per node, all in this process. */
+void node_block(int n, int nodes, int node, int *begin, int *end);
+void node_generate(struct node_instance *inst, int n, int width, uint64_t seed, const struct transport *t,
+                   int nthreads);
+void node_attach(struct node_instance *inst, const struct instance *whole, const struct transport *t,
+                 int nthreads);
+void node_instance_free(struct node_instance *inst);
+void node_state_alloc(struct match_state *st, const struct node_instance *inst);
+void node_state_free(struct match_state *st);
+void distributed_solve(const struct node_instance *inst, struct match_state *st, struct transport *t,
+                       struct distributed_stats *stats);
+bool distributed_verify(const struct node_instance *inst, const struct match_state *st, struct transport *t);
+void distributed_gather(const struct node_instance *inst, const struct match_state *st, struct transport *t,
+                        int *matches);
+void run_thread_nodes(int nodes, void (*node_main)(struct transport *t, void *arg), void *arg);
+#ifdef SM_MPI
+/* The nodes as the processes of an MPI job, one transport each, between MPI_Init
+   in mpi_transport_init and MPI_Finalize in mpi_transport_finish */
+void mpi_transport_init(struct transport *t, int *argc, char ***argv);
+void mpi_transport_finish(struct transport *t);
+#endif
+
+/* Runs body(arg, begin, end) over slices of [0, count) on nthreads threads */
+void parallel_for(int nthreads, int count, void (*body)(void *arg, int begin, int end), void *arg);
+
+#endif